@@ -0,0 +1,283 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_gap_ble_api.h"
+#include "beacon.h"
+
+#define COMPANY_ID_APPLE        0x004C
+#define SERVICE_UUID_EDDYSTONE  0xFEAA
+
+#define IBEACON_TYPE            0x02
+#define IBEACON_LEN             0x15
+
+#define EDDYSTONE_FRAME_UID     0x00
+#define EDDYSTONE_FRAME_URL     0x10
+#define EDDYSTONE_FRAME_TLM     0x20
+
+#define BEACON_DECODE_EDDYSTONE (CONFIG_EXAMPLE_BEACON_EDDYSTONE_UID || CONFIG_EXAMPLE_BEACON_EDDYSTONE_URL || CONFIG_EXAMPLE_BEACON_EDDYSTONE_TLM)
+
+/* data points past the 16-bit key (company ID or service UUID) of the AD structure */
+typedef bool (*beacon_decode_fn)(const uint8_t* data, uint8_t len, beacon_record_t* record);
+
+typedef struct {
+  uint16_t key;
+  beacon_decode_fn decode;
+} beacon_decoder_t;
+
+static inline uint16_t get_le16(const uint8_t* p) {
+  return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static inline uint16_t get_be16(const uint8_t* p) {
+  return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static inline uint32_t get_be32(const uint8_t* p) {
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+#if CONFIG_EXAMPLE_BEACON_IBEACON
+static bool decode_ibeacon(const uint8_t* data, uint8_t len, beacon_record_t* record) {
+
+  if (len != 2 + IBEACON_LEN || data[0] != IBEACON_TYPE || data[1] != IBEACON_LEN) {
+    return false;
+  }
+
+  record->type = BEACON_TYPE_IBEACON;
+  memcpy(record->ibeacon.uuid, &data[2], sizeof(record->ibeacon.uuid));
+  record->ibeacon.major = get_be16(&data[18]);
+  record->ibeacon.minor = get_be16(&data[20]);
+  record->ibeacon.measured_power = (int8_t)data[22];
+
+  return true;
+}
+#endif
+
+#if CONFIG_EXAMPLE_BEACON_CUSTOM
+static bool decode_custom(const uint8_t* data, uint8_t len, beacon_record_t* record) {
+
+  if (len > BEACON_CUSTOM_MAX_LEN) {
+    return false;
+  }
+
+  record->type = BEACON_TYPE_CUSTOM;
+  record->custom.company_id = CONFIG_EXAMPLE_BEACON_CUSTOM_COMPANY_ID;
+  record->custom.len = len;
+  memcpy(record->custom.data, data, len);
+
+  return true;
+}
+#endif
+
+#if CONFIG_EXAMPLE_BEACON_EDDYSTONE_UID
+static bool decode_eddystone_uid(const uint8_t* data, uint8_t len, beacon_record_t* record) {
+
+  // frame type, tx power, 10 byte namespace, 6 byte instance (+ 2 reserved bytes, optional)
+  if (len < 18) {
+    return false;
+  }
+
+  record->type = BEACON_TYPE_EDDYSTONE_UID;
+  record->eddystone_uid.tx_power = (int8_t)data[1];
+  memcpy(record->eddystone_uid.namespace_id, &data[2], sizeof(record->eddystone_uid.namespace_id));
+  memcpy(record->eddystone_uid.instance_id, &data[12], sizeof(record->eddystone_uid.instance_id));
+
+  return true;
+}
+#endif
+
+#if CONFIG_EXAMPLE_BEACON_EDDYSTONE_URL
+static const char* const eddystone_url_schemes[] = {
+  "http://www.", "https://www.", "http://", "https://",
+};
+
+static const char* const eddystone_url_expansions[] = {
+  ".com/", ".org/", ".edu/", ".net/", ".info/", ".biz/", ".gov/",
+  ".com", ".org", ".edu", ".net", ".info", ".biz", ".gov",
+};
+
+static bool decode_eddystone_url(const uint8_t* data, uint8_t len, beacon_record_t* record) {
+
+  // frame type, tx power, scheme prefix, encoded url
+  if (len < 3 || data[2] >= sizeof(eddystone_url_schemes) / sizeof(eddystone_url_schemes[0])) {
+    return false;
+  }
+
+  char* url = record->eddystone_url.url;
+  size_t pos = strlcpy(url, eddystone_url_schemes[data[2]], BEACON_URL_MAX_LEN + 1);
+
+  for (int idx = 3; idx < len && pos < BEACON_URL_MAX_LEN; idx++) {
+    if (data[idx] < sizeof(eddystone_url_expansions) / sizeof(eddystone_url_expansions[0])) {
+      pos += strlcpy(&url[pos], eddystone_url_expansions[data[idx]], BEACON_URL_MAX_LEN + 1 - pos);
+    }
+    else if (data[idx] > 0x20 && data[idx] < 0x7F) {
+      url[pos++] = (char)data[idx];
+    }
+    else {
+      return false;
+    }
+  }
+  url[pos < BEACON_URL_MAX_LEN ? pos : BEACON_URL_MAX_LEN] = '\0';
+
+  record->type = BEACON_TYPE_EDDYSTONE_URL;
+  record->eddystone_url.tx_power = (int8_t)data[1];
+
+  return true;
+}
+#endif
+
+#if CONFIG_EXAMPLE_BEACON_EDDYSTONE_TLM
+static bool decode_eddystone_tlm(const uint8_t* data, uint8_t len, beacon_record_t* record) {
+
+  // frame type, version 0 (unencrypted), vbatt, temp, adv count, sec count
+  if (len < 14 || data[1] != 0x00) {
+    return false;
+  }
+
+  record->type = BEACON_TYPE_EDDYSTONE_TLM;
+  record->eddystone_tlm.vbatt_mv = get_be16(&data[2]);
+  record->eddystone_tlm.temp_q8 = (int16_t)get_be16(&data[4]);
+  record->eddystone_tlm.adv_cnt = get_be32(&data[6]);
+  record->eddystone_tlm.sec_cnt = get_be32(&data[10]);
+
+  return true;
+}
+#endif
+
+#if BEACON_DECODE_EDDYSTONE
+/* Indexed by the high nibble of the Eddystone frame type */
+static const beacon_decode_fn eddystone_frame_decoders[16] = {
+#if CONFIG_EXAMPLE_BEACON_EDDYSTONE_UID
+  [EDDYSTONE_FRAME_UID >> 4] = decode_eddystone_uid,
+#endif
+#if CONFIG_EXAMPLE_BEACON_EDDYSTONE_URL
+  [EDDYSTONE_FRAME_URL >> 4] = decode_eddystone_url,
+#endif
+#if CONFIG_EXAMPLE_BEACON_EDDYSTONE_TLM
+  [EDDYSTONE_FRAME_TLM >> 4] = decode_eddystone_tlm,
+#endif
+};
+
+static bool decode_eddystone(const uint8_t* data, uint8_t len, beacon_record_t* record) {
+
+  if (len < 1 || (data[0] & 0x0F) != 0) {
+    return false;
+  }
+
+  beacon_decode_fn decode = eddystone_frame_decoders[data[0] >> 4];
+
+  return decode != NULL && decode(data, len, record);
+}
+#endif
+
+/* Decoder tables, keyed by company ID and by 16-bit service UUID. Formats that are
+ * disabled in menuconfig are not referenced here, so the linker drops them. */
+static const beacon_decoder_t mfg_decoders[] = {
+#if CONFIG_EXAMPLE_BEACON_IBEACON
+  { COMPANY_ID_APPLE, decode_ibeacon },
+#endif
+#if CONFIG_EXAMPLE_BEACON_CUSTOM
+  { CONFIG_EXAMPLE_BEACON_CUSTOM_COMPANY_ID, decode_custom },
+#endif
+  { 0, NULL },
+};
+
+static const beacon_decoder_t service_data_decoders[] = {
+#if BEACON_DECODE_EDDYSTONE
+  { SERVICE_UUID_EDDYSTONE, decode_eddystone },
+#endif
+  { 0, NULL },
+};
+
+/* Indexed by AD type, so every AD structure costs one load to reject or dispatch */
+static const beacon_decoder_t* const ad_type_decoders[256] = {
+  [ESP_BLE_AD_MANUFACTURER_SPECIFIC_TYPE] = mfg_decoders,
+  [ESP_BLE_AD_TYPE_SERVICE_DATA] = service_data_decoders,
+};
+
+bool beacon_decode(const uint8_t* payload, uint16_t len, beacon_record_t* record) {
+
+  uint16_t pos = 0;
+
+  record->type = BEACON_TYPE_NONE;
+
+  while (pos + 1 < len) {
+    uint8_t field_len = payload[pos];
+
+    if (field_len == 0 || pos + 1 + field_len > len) {
+      break;
+    }
+
+    const beacon_decoder_t* decoder = ad_type_decoders[payload[pos + 1]];
+    // AD type byte + 16-bit key
+    if (decoder != NULL && field_len >= 3) {
+      uint16_t key = get_le16(&payload[pos + 2]);
+
+      for (; decoder->decode != NULL; decoder++) {
+        if (decoder->key == key) {
+          if (decoder->decode(&payload[pos + 4], field_len - 3, record)) {
+            return true;
+          }
+          break;
+        }
+      }
+    }
+
+    pos += 1 + field_len;
+  }
+
+  return false;
+}
+
+const char* beacon_type_name(beacon_type_t type) {
+
+  switch (type) {
+  case BEACON_TYPE_IBEACON:
+    return "iBeacon";
+  case BEACON_TYPE_EDDYSTONE_UID:
+    return "Eddystone-UID";
+  case BEACON_TYPE_EDDYSTONE_URL:
+    return "Eddystone-URL";
+  case BEACON_TYPE_EDDYSTONE_TLM:
+    return "Eddystone-TLM";
+  case BEACON_TYPE_CUSTOM:
+    return "Custom";
+  default:
+    return "None";
+  }
+}
+
+void beacon_print(const beacon_record_t* record) {
+
+  switch (record->type) {
+  case BEACON_TYPE_IBEACON:
+    printf("%s major %u minor %u power %d", beacon_type_name(record->type),
+      record->ibeacon.major, record->ibeacon.minor, record->ibeacon.measured_power);
+    break;
+  case BEACON_TYPE_EDDYSTONE_UID:
+    printf("%s ns ", beacon_type_name(record->type));
+    for (int idx = 0; idx < sizeof(record->eddystone_uid.namespace_id); idx++) {
+      printf("%02x", record->eddystone_uid.namespace_id[idx]);
+    }
+    printf(" inst ");
+    for (int idx = 0; idx < sizeof(record->eddystone_uid.instance_id); idx++) {
+      printf("%02x", record->eddystone_uid.instance_id[idx]);
+    }
+    break;
+  case BEACON_TYPE_EDDYSTONE_URL:
+    printf("%s %s", beacon_type_name(record->type), record->eddystone_url.url);
+    break;
+  case BEACON_TYPE_EDDYSTONE_TLM: {
+    int temp_c100 = record->eddystone_tlm.temp_q8 * 100 / 256;
+    printf("%s %u mV %s%d.%02d C", beacon_type_name(record->type), record->eddystone_tlm.vbatt_mv,
+      temp_c100 < 0 ? "-" : "", abs(temp_c100) / 100, abs(temp_c100) % 100);
+    break;
+  }
+  case BEACON_TYPE_CUSTOM:
+    printf("%s 0x%04x len %u", beacon_type_name(record->type), record->custom.company_id, record->custom.len);
+    break;
+  default:
+    break;
+  }
+}
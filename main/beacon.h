@@ -0,0 +1,75 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "sdkconfig.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define BEACON_URL_MAX_LEN    48
+#define BEACON_CUSTOM_MAX_LEN 27
+
+  typedef enum {
+    BEACON_TYPE_NONE = 0,
+    BEACON_TYPE_IBEACON,
+    BEACON_TYPE_EDDYSTONE_UID,
+    BEACON_TYPE_EDDYSTONE_URL,
+    BEACON_TYPE_EDDYSTONE_TLM,
+    BEACON_TYPE_CUSTOM,
+  } beacon_type_t;
+
+  typedef struct {
+    uint8_t uuid[16];
+    uint16_t major;
+    uint16_t minor;
+    int8_t measured_power;  // RSSI at 1 m
+  } beacon_ibeacon_t;
+
+  typedef struct {
+    int8_t tx_power;        // RSSI at 0 m
+    uint8_t namespace_id[10];
+    uint8_t instance_id[6];
+  } beacon_eddystone_uid_t;
+
+  typedef struct {
+    int8_t tx_power;        // RSSI at 0 m
+    char url[BEACON_URL_MAX_LEN + 1];
+  } beacon_eddystone_url_t;
+
+  typedef struct {
+    uint16_t vbatt_mv;
+    int16_t temp_q8;        // degrees Celsius, signed 8.8 fixed point
+    uint32_t adv_cnt;
+    uint32_t sec_cnt;       // 0.1 s resolution
+  } beacon_eddystone_tlm_t;
+
+  typedef struct {
+    uint16_t company_id;
+    uint8_t len;
+    uint8_t data[BEACON_CUSTOM_MAX_LEN];
+  } beacon_custom_t;
+
+  typedef struct {
+    beacon_type_t type;
+    union {
+      beacon_ibeacon_t ibeacon;
+      beacon_eddystone_uid_t eddystone_uid;
+      beacon_eddystone_url_t eddystone_url;
+      beacon_eddystone_tlm_t eddystone_tlm;
+      beacon_custom_t custom;
+    };
+  } beacon_record_t;
+
+  /* Walk the AD structures of a raw adv + scan response payload and run the first decoder
+   * registered for the AD type / company ID / service UUID found. Returns true if a record was decoded. */
+  bool beacon_decode(const uint8_t* payload, uint16_t len, beacon_record_t* record);
+  const char* beacon_type_name(beacon_type_t type);
+  void beacon_print(const beacon_record_t* record);
+
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,646 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_rom_crc.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/timers.h"
+#include "blob_xfer.h"
+#include "gattc_ops.h"
+#include "mem_budget.h"
+
+#define TAG "BLOB_XFER"
+
+// A full window must leave an operation for the CHECKPOINT and END writes and the polls
+_Static_assert(CONFIG_EXAMPLE_BLOB_WINDOW * CONFIG_EXAMPLE_BLOB_MAX_SESSIONS < CONFIG_EXAMPLE_GATTC_OPS_MAX,
+  "blob transfer windows take every GATT client operation");
+
+#define PUMP_MS         100
+#define HEADER_LEN      5
+#define CTRL_LEN        9
+#define MAX_REWINDS     5
+
+// Slot index of the control packet in the write callback argument
+#define CTRL_SLOT       0xFF
+
+typedef enum {
+  BLOB_FREE = 0,
+  BLOB_STARTING,
+  BLOB_SENDING,
+  BLOB_ENDING,
+  BLOB_PAUSED,
+  BLOB_DONE,
+  BLOB_FAILED,
+} blob_state_t;
+
+static const char* state_names[] = { "free", "starting", "sending", "ending", "paused", "done", "failed" };
+
+typedef struct {
+  bool in_use;
+  uint8_t buf[CONFIG_EXAMPLE_BLOB_MAX_CHUNK];
+} blob_slot_t;
+
+typedef struct {
+  blob_state_t state;
+  uint8_t generation;       // bumped on every rewind, completions of older writes are ignored
+  uint8_t rewinds;          // since the last acknowledged checkpoint
+  bool ctrl_busy;
+  uint16_t conn_id;
+  uint16_t handle;
+  uint16_t payload_len;     // data bytes per chunk, from the MTU when the transfer (re)started
+  esp_bd_addr_t bda;
+  blob_xfer_source_t source;
+  uint32_t next_offset;     // next byte to send
+  uint32_t checkpoint_offset;
+  uint32_t acked_offset;    // everything before this is confirmed by the peripheral
+  uint32_t crc;             // crc32 of the source up to crc_offset, only touched by the pump
+  uint32_t crc_offset;
+  int64_t active_since_us;
+  int64_t active_us;
+  uint32_t bytes_sent;      // payload handed to the stack, re-sends included
+  uint32_t bytes_acked;
+  uint32_t checkpoints;
+  uint32_t rewinds_total;
+  uint32_t resumes;
+  uint32_t submit_failures;
+  blob_xfer_done_cb_t cb;
+  void* arg;
+  uint8_t ctrl[CTRL_LEN];
+  blob_slot_t slots[CONFIG_EXAMPLE_BLOB_WINDOW];
+} blob_session_t;
+
+// Writes picked under the lock, filled and submitted by the pump after releasing it
+typedef struct {
+  uint8_t slot;
+  uint16_t len;
+  uint32_t offset;
+} blob_submit_t;
+
+static blob_session_t sessions[CONFIG_EXAMPLE_BLOB_MAX_SESSIONS];
+static SemaphoreHandle_t blob_lock = NULL;
+static TimerHandle_t pump_timer = NULL;
+static volatile bool pump_requested = false;
+#if CONFIG_EXAMPLE_STATIC_ALLOCATION
+static StaticSemaphore_t blob_lock_buffer;
+static StaticTimer_t pump_timer_buffer;
+#endif
+
+static void put_u32(uint8_t* dst, uint32_t value) {
+
+  dst[0] = value & 0xFF;
+  dst[1] = (value >> 8) & 0xFF;
+  dst[2] = (value >> 16) & 0xFF;
+  dst[3] = (value >> 24) & 0xFF;
+}
+
+static bool session_active(const blob_session_t* session) {
+  return session->state == BLOB_STARTING || session->state == BLOB_SENDING || session->state == BLOB_ENDING;
+}
+
+static uint16_t payload_len_for(uint16_t conn_id) {
+
+  uint16_t chunk = gattc_ops_get_mtu(conn_id) - 3;
+
+  if (chunk > CONFIG_EXAMPLE_BLOB_MAX_CHUNK) {
+    chunk = CONFIG_EXAMPLE_BLOB_MAX_CHUNK;
+  }
+
+  return chunk - HEADER_LEN;
+}
+
+static void stop_clock(blob_session_t* session) {
+
+  if (session->active_since_us != 0) {
+    session->active_us += esp_timer_get_time() - session->active_since_us;
+    session->active_since_us = 0;
+  }
+}
+
+// All rewinds go back to the last acknowledged checkpoint
+static void rewind_session(blob_session_t* session) {
+
+  session->generation++;
+  session->next_offset = session->acked_offset;
+  session->checkpoint_offset = session->acked_offset;
+}
+
+/* The functions below are called with blob_lock held. The ones that end a transfer return true
+ * when the completion callback should run once the lock is released. */
+static bool fail_session(blob_session_t* session, esp_err_t err, esp_err_t* result) {
+
+  ESP_LOGE(TAG, "%s: Transfer on conn_id %d failed at %u of %u bytes, %s", __func__, session->conn_id,
+    session->acked_offset, session->source.size, esp_err_to_name(err));
+  stop_clock(session);
+  session->generation++;
+  session->state = BLOB_FAILED;
+  *result = err;
+
+  return session->cb != NULL;
+}
+
+static void pause_session(blob_session_t* session) {
+
+  ESP_LOGI(TAG, "Transfer on conn_id %d paused at %u of %u bytes", session->conn_id,
+    session->acked_offset, session->source.size);
+  stop_clock(session);
+  rewind_session(session);
+  session->state = BLOB_PAUSED;
+}
+
+static void on_write_done(const gattc_op_result_t* result, void* arg);
+
+static uint32_t submit_write(blob_session_t* session, uint8_t generation, uint8_t slot,
+  const uint8_t* value, uint16_t len, esp_gatt_write_type_t write_type) {
+
+  void* arg = (void*)(uintptr_t)((session - sessions) | (slot << 8) | (generation << 16));
+
+  return gattc_op_write_char(session->conn_id, session->handle, value, len, write_type, on_write_done, arg);
+}
+
+static void pump_session(int idx) {
+
+  blob_session_t* session = &sessions[idx];
+  blob_submit_t submits[CONFIG_EXAMPLE_BLOB_WINDOW];
+  int count = 0;
+  uint8_t ctrl_op = 0;
+  uint32_t prev_checkpoint = 0;
+  uint8_t generation;
+  esp_err_t err = ESP_OK;
+  bool finished = false;
+
+  xSemaphoreTake(blob_lock, portMAX_DELAY);
+
+  generation = session->generation;
+  if (session->state == BLOB_STARTING && !session->ctrl_busy) {
+    ctrl_op = BLOB_XFER_OP_START;
+    session->ctrl[0] = BLOB_XFER_OP_START;
+    put_u32(&session->ctrl[1], session->source.size);
+    put_u32(&session->ctrl[5], session->acked_offset);
+  }
+  else if (session->state == BLOB_SENDING) {
+    for (int slot = 0; slot < CONFIG_EXAMPLE_BLOB_WINDOW && session->next_offset < session->source.size; slot++) {
+      if (session->slots[slot].in_use) {
+        continue;
+      }
+
+      uint32_t len = session->source.size - session->next_offset;
+      if (len > session->payload_len) {
+        len = session->payload_len;
+      }
+
+      session->slots[slot].in_use = true;
+      submits[count].slot = slot;
+      submits[count].offset = session->next_offset;
+      submits[count].len = len;
+      count++;
+      session->next_offset += len;
+    }
+
+    bool window_empty = true;
+    for (int slot = 0; slot < CONFIG_EXAMPLE_BLOB_WINDOW; slot++) {
+      window_empty = window_empty && !session->slots[slot].in_use;
+    }
+
+    // Checkpoints go after the data they cover. END doubles as the final checkpoint.
+    if (!session->ctrl_busy && session->next_offset == session->source.size && window_empty) {
+      ctrl_op = BLOB_XFER_OP_END;
+      session->state = BLOB_ENDING;
+      session->ctrl[0] = BLOB_XFER_OP_END;
+      put_u32(&session->ctrl[1], session->source.size);
+      // Filled in below, the crc is complete once all data has been read
+    }
+    else if (!session->ctrl_busy &&
+      session->next_offset - session->checkpoint_offset >= CONFIG_EXAMPLE_BLOB_CHECKPOINT_BYTES) {
+      ctrl_op = BLOB_XFER_OP_CHECKPOINT;
+      prev_checkpoint = session->checkpoint_offset;
+      session->checkpoint_offset = session->next_offset;
+      session->ctrl[0] = BLOB_XFER_OP_CHECKPOINT;
+      put_u32(&session->ctrl[1], session->next_offset);
+    }
+  }
+  if (ctrl_op != 0) {
+    session->ctrl_busy = true;
+  }
+
+  xSemaphoreGive(blob_lock);
+
+  // The slots are ours until their writes complete, read the source without holding the lock
+  int sent = 0;
+  for (; sent < count; sent++) {
+    blob_slot_t* slot = &session->slots[submits[sent].slot];
+    uint32_t offset = submits[sent].offset;
+    uint16_t len = submits[sent].len;
+
+    slot->buf[0] = BLOB_XFER_OP_DATA;
+    put_u32(&slot->buf[1], offset);
+    err = session->source.read(session->source.ctx, offset, &slot->buf[HEADER_LEN], len);
+    if (err != ESP_OK) {
+      break;
+    }
+    if (offset <= session->crc_offset && session->crc_offset < offset + len) {
+      session->crc = esp_rom_crc32_le(session->crc, &slot->buf[HEADER_LEN + session->crc_offset - offset],
+        offset + len - session->crc_offset);
+      session->crc_offset = offset + len;
+    }
+
+    if (submit_write(session, generation, submits[sent].slot, slot->buf, HEADER_LEN + len,
+      ESP_GATT_WRITE_TYPE_NO_RSP) == GATTC_OP_INVALID_ID) {
+      break;
+    }
+    session->bytes_sent += len;
+  }
+  if (sent == count && err == ESP_OK && ctrl_op != 0) {
+    uint16_t len = ctrl_op == BLOB_XFER_OP_CHECKPOINT ? HEADER_LEN : CTRL_LEN;
+
+    if (ctrl_op == BLOB_XFER_OP_END) {
+      put_u32(&session->ctrl[5], session->crc);
+    }
+    if (submit_write(session, generation, CTRL_SLOT, session->ctrl, len, ESP_GATT_WRITE_TYPE_RSP) != GATTC_OP_INVALID_ID) {
+      ctrl_op = 0;
+    }
+  }
+
+  if (sent == count && ctrl_op == 0) {
+    return;
+  }
+
+  // Hand back whatever wasn't submitted. Nothing after it went out either, so the stream stays gap free.
+  xSemaphoreTake(blob_lock, portMAX_DELAY);
+  for (int idx = sent; idx < count; idx++) {
+    session->slots[submits[idx].slot].in_use = false;
+  }
+  if (ctrl_op != 0) {
+    session->ctrl_busy = false;
+  }
+  if (session->generation == generation) {
+    if (err != ESP_OK) {
+      ESP_LOGE(TAG, "%s: Source read error %s", __func__, esp_err_to_name(err));
+      finished = fail_session(session, ESP_FAIL, &err);
+    }
+    else {
+      session->submit_failures++;
+      if (sent < count) {
+        session->next_offset = submits[sent].offset;
+      }
+      if (ctrl_op == BLOB_XFER_OP_CHECKPOINT) {
+        session->checkpoint_offset = prev_checkpoint;
+      }
+      else if (ctrl_op == BLOB_XFER_OP_END) {
+        session->state = BLOB_SENDING;
+      }
+    }
+  }
+  xSemaphoreGive(blob_lock);
+
+  if (finished) {
+    session->cb(session->bda, err, session->arg);
+  }
+}
+
+static void pump_pended(void* param1, uint32_t param2) {
+
+  pump_requested = false;
+  for (int idx = 0; idx < CONFIG_EXAMPLE_BLOB_MAX_SESSIONS; idx++) {
+    pump_session(idx);
+  }
+}
+
+// All sending happens in the timer task, so writes reach gattc_ops in the order they were picked
+static void request_pump() {
+
+  if (!pump_requested) {
+    pump_requested = true;
+    if (xTimerPendFunctionCall(pump_pended, NULL, 0, 0) != pdPASS) {
+      // The periodic pump picks it up
+      pump_requested = false;
+    }
+  }
+}
+
+static void on_write_done(const gattc_op_result_t* result, void* arg) {
+
+  blob_session_t* session = &sessions[(uintptr_t)arg & 0xFF];
+  uint8_t slot = ((uintptr_t)arg >> 8) & 0xFF;
+  uint8_t generation = ((uintptr_t)arg >> 16) & 0xFF;
+  esp_err_t err = ESP_OK;
+  bool finished = false;
+
+  xSemaphoreTake(blob_lock, portMAX_DELAY);
+
+  if (slot == CTRL_SLOT) {
+    session->ctrl_busy = false;
+  }
+  else {
+    session->slots[slot].in_use = false;
+  }
+
+  if (session->generation == generation && session_active(session)) {
+    if (result->err == ESP_ERR_INVALID_STATE) {
+      pause_session(session);
+    }
+    else if (result->err != ESP_OK) {
+      // The peripheral refused a checkpoint or a write was lost, go back to the last good one
+      if (slot != CTRL_SLOT || session->state == BLOB_SENDING) {
+        session->rewinds_total++;
+        if (++session->rewinds > MAX_REWINDS) {
+          finished = fail_session(session, ESP_FAIL, &err);
+        }
+        else {
+          ESP_LOGW(TAG, "Rewinding conn_id %d to %u", session->conn_id, session->acked_offset);
+          rewind_session(session);
+        }
+      }
+      else {
+        finished = fail_session(session, ESP_FAIL, &err);
+      }
+    }
+    else if (slot == CTRL_SLOT) {
+      uint32_t acked = session->state == BLOB_ENDING ? session->source.size : session->checkpoint_offset;
+
+      session->bytes_acked += acked - session->acked_offset;
+      session->acked_offset = acked;
+      session->rewinds = 0;
+      if (session->state == BLOB_STARTING) {
+        session->state = BLOB_SENDING;
+        session->active_since_us = esp_timer_get_time();
+      }
+      else if (session->state == BLOB_ENDING) {
+        stop_clock(session);
+        session->state = BLOB_DONE;
+        finished = session->cb != NULL;
+        ESP_LOGI(TAG, "Transfer on conn_id %d done, %u bytes", session->conn_id, session->source.size);
+      }
+      else {
+        session->checkpoints++;
+      }
+    }
+  }
+
+  xSemaphoreGive(blob_lock);
+
+  if (finished) {
+    session->cb(session->bda, err, session->arg);
+  }
+  request_pump();
+}
+
+static void vTimerCallbackPump(TimerHandle_t pxTimer) {
+  pump_pended(NULL, 0);
+}
+
+static esp_err_t read_partition(void* ctx, uint32_t offset, uint8_t* dst, size_t len) {
+  return esp_partition_read((const esp_partition_t*)ctx, offset, dst, len);
+}
+
+static esp_err_t read_buffer(void* ctx, uint32_t offset, uint8_t* dst, size_t len) {
+
+  memcpy(dst, (const uint8_t*)ctx + offset, len);
+
+  return ESP_OK;
+}
+
+esp_err_t blob_xfer_source_partition(const esp_partition_t* partition, uint32_t size, blob_xfer_source_t* source) {
+
+  if (partition == NULL || size == 0 || size > partition->size) {
+    ESP_LOGE(TAG, "%s: Invalid partition or size", __func__);
+    return ESP_ERR_INVALID_ARG;
+  }
+
+  source->read = read_partition;
+  source->ctx = (void*)partition;
+  source->size = size;
+
+  return ESP_OK;
+}
+
+esp_err_t blob_xfer_source_buffer(const uint8_t* data, uint32_t size, blob_xfer_source_t* source) {
+
+  if (data == NULL || size == 0) {
+    return ESP_ERR_INVALID_ARG;
+  }
+
+  source->read = read_buffer;
+  source->ctx = (void*)data;
+  source->size = size;
+
+  return ESP_OK;
+}
+
+esp_err_t blob_xfer_init() {
+
+#if CONFIG_EXAMPLE_STATIC_ALLOCATION
+  blob_lock = xSemaphoreCreateMutexStatic(&blob_lock_buffer);
+#else
+  blob_lock = xSemaphoreCreateMutex();
+#endif
+  if (blob_lock == NULL) {
+    ESP_LOGE(TAG, "%s: Unable to create lock", __func__);
+    return ESP_ERR_NO_MEM;
+  }
+
+#if CONFIG_EXAMPLE_STATIC_ALLOCATION
+  pump_timer = xTimerCreateStatic(
+    "BlobPump",
+    pdMS_TO_TICKS(PUMP_MS),
+    pdTRUE, // auto reload
+    (void*)0,
+    vTimerCallbackPump,
+    &pump_timer_buffer
+  );
+  mem_budget_add("blob_xfer", sizeof(sessions) + sizeof(blob_lock_buffer) + sizeof(pump_timer_buffer));
+#else
+  pump_timer = xTimerCreate(
+    "BlobPump",
+    pdMS_TO_TICKS(PUMP_MS),
+    pdTRUE, // auto reload
+    (void*)0,
+    vTimerCallbackPump
+  );
+  mem_budget_add("blob_xfer", sizeof(sessions));
+#endif
+  if (pump_timer == NULL || xTimerStart(pump_timer, 0) != pdPASS) {
+    ESP_LOGE(TAG, "%s: Unable to start pump timer", __func__);
+    return ESP_FAIL;
+  }
+
+  return ESP_OK;
+}
+
+esp_err_t blob_xfer_start(uint16_t conn_id, uint16_t handle, const blob_xfer_source_t* source,
+  blob_xfer_done_cb_t cb, void* arg) {
+
+  blob_session_t* session = NULL;
+  esp_bd_addr_t bda;
+  esp_err_t ret = ESP_OK;
+
+  if (blob_lock == NULL || source == NULL || source->read == NULL || source->size == 0) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  if (!gattc_ops_get_remote_bda(conn_id, bda)) {
+    ESP_LOGE(TAG, "%s: No link with conn_id %d", __func__, conn_id);
+    return ESP_ERR_INVALID_ARG;
+  }
+
+  xSemaphoreTake(blob_lock, portMAX_DELAY);
+
+  for (int idx = 0; idx < CONFIG_EXAMPLE_BLOB_MAX_SESSIONS; idx++) {
+    blob_session_t* candidate = &sessions[idx];
+
+    if (session_active(candidate) && candidate->conn_id == conn_id) {
+      ret = ESP_ERR_INVALID_STATE;
+      break;
+    }
+    // A new transfer to a device replaces the one waiting for it to come back
+    if (candidate->state == BLOB_PAUSED && memcmp(candidate->bda, bda, sizeof(esp_bd_addr_t)) == 0) {
+      session = candidate;
+    }
+    else if (session == NULL && !session_active(candidate) && candidate->state != BLOB_PAUSED) {
+      session = candidate;
+    }
+  }
+
+  if (ret == ESP_OK && session == NULL) {
+    ESP_LOGE(TAG, "%s: Session table full", __func__);
+    ret = ESP_ERR_NO_MEM;
+  }
+
+  if (ret == ESP_OK) {
+    // Slots may still be held by writes of an earlier transfer, the generation keeps them apart
+    session->state = BLOB_STARTING;
+    session->generation++;
+    session->rewinds = 0;
+    session->conn_id = conn_id;
+    session->handle = handle;
+    session->payload_len = payload_len_for(conn_id);
+    memcpy(session->bda, bda, sizeof(esp_bd_addr_t));
+    session->source = *source;
+    session->next_offset = 0;
+    session->checkpoint_offset = 0;
+    session->acked_offset = 0;
+    session->crc = 0;
+    session->crc_offset = 0;
+    session->active_since_us = 0;
+    session->active_us = 0;
+    session->bytes_sent = 0;
+    session->bytes_acked = 0;
+    session->checkpoints = 0;
+    session->rewinds_total = 0;
+    session->resumes = 0;
+    session->submit_failures = 0;
+    session->cb = cb;
+    session->arg = arg;
+    ESP_LOGI(TAG, "Sending %u bytes to conn_id %d, %d bytes per chunk", source->size, conn_id,
+      session->payload_len);
+  }
+
+  xSemaphoreGive(blob_lock);
+
+  if (ret == ESP_OK) {
+    request_pump();
+  }
+
+  return ret;
+}
+
+void blob_xfer_abort(uint16_t conn_id) {
+
+  blob_session_t* aborted = NULL;
+  esp_err_t err = ESP_OK;
+
+  if (blob_lock == NULL) {
+    return;
+  }
+
+  xSemaphoreTake(blob_lock, portMAX_DELAY);
+  for (int idx = 0; idx < CONFIG_EXAMPLE_BLOB_MAX_SESSIONS; idx++) {
+    if (session_active(&sessions[idx]) && sessions[idx].conn_id == conn_id) {
+      if (fail_session(&sessions[idx], ESP_ERR_INVALID_STATE, &err)) {
+        aborted = &sessions[idx];
+      }
+    }
+  }
+  xSemaphoreGive(blob_lock);
+
+  if (aborted != NULL) {
+    aborted->cb(aborted->bda, err, aborted->arg);
+  }
+}
+
+void blob_xfer_on_disconnect(uint16_t conn_id) {
+
+  if (blob_lock == NULL) {
+    return;
+  }
+
+  xSemaphoreTake(blob_lock, portMAX_DELAY);
+  for (int idx = 0; idx < CONFIG_EXAMPLE_BLOB_MAX_SESSIONS; idx++) {
+    if (session_active(&sessions[idx]) && sessions[idx].conn_id == conn_id) {
+      pause_session(&sessions[idx]);
+    }
+  }
+  xSemaphoreGive(blob_lock);
+}
+
+void blob_xfer_on_link_ready(uint16_t conn_id, const esp_bd_addr_t bda) {
+
+  bool resumed = false;
+
+  if (blob_lock == NULL) {
+    return;
+  }
+
+  xSemaphoreTake(blob_lock, portMAX_DELAY);
+  for (int idx = 0; idx < CONFIG_EXAMPLE_BLOB_MAX_SESSIONS; idx++) {
+    blob_session_t* session = &sessions[idx];
+
+    if (session->state == BLOB_PAUSED && memcmp(session->bda, bda, sizeof(esp_bd_addr_t)) == 0) {
+      // START carries the offset to continue from, the MTU may differ from the last connection
+      session->state = BLOB_STARTING;
+      session->conn_id = conn_id;
+      session->payload_len = payload_len_for(conn_id);
+      session->resumes++;
+      resumed = true;
+      ESP_LOGI(TAG, "Resuming transfer on conn_id %d at %u of %u bytes", conn_id,
+        session->acked_offset, session->source.size);
+    }
+  }
+  xSemaphoreGive(blob_lock);
+
+  if (resumed) {
+    request_pump();
+  }
+}
+
+void display_blob_xfer_stats() {
+
+  if (blob_lock == NULL) {
+    return;
+  }
+
+  xSemaphoreTake(blob_lock, portMAX_DELAY);
+  for (int idx = 0; idx < CONFIG_EXAMPLE_BLOB_MAX_SESSIONS; idx++) {
+    blob_session_t* session = &sessions[idx];
+
+    if (session->state == BLOB_FREE) {
+      continue;
+    }
+
+    int64_t active_us = session->active_us;
+    if (session->active_since_us != 0) {
+      active_us += esp_timer_get_time() - session->active_since_us;
+    }
+
+    // Sustained rate counts acknowledged bytes over the time spent connected and sending
+    printf("Blob conn_id %d [%02x:%02x:%02x:%02x:%02x:%02x] %s, %u/%u bytes acked, %u.%02u kB/s\n",
+      session->conn_id, session->bda[0], session->bda[1], session->bda[2], session->bda[3], session->bda[4],
+      session->bda[5], state_names[session->state], session->acked_offset, session->source.size,
+      active_us > 0 ? (uint32_t)(session->bytes_acked * 1000LL / active_us) : 0,
+      active_us > 0 ? (uint32_t)(session->bytes_acked * 100000LL / active_us % 100) : 0);
+    printf("  chunk %d bytes, sent %u bytes, checkpoints %u, rewinds %u, resumes %u, submit failures %u\n",
+      session->payload_len, session->bytes_sent, session->checkpoints, session->rewinds_total,
+      session->resumes, session->submit_failures);
+  }
+  xSemaphoreGive(blob_lock);
+}
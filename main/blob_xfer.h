@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+#include "esp_gap_ble_api.h"
+#include "esp_partition.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+  /* Packets written to the peripheral's characteristic, all fields little endian.
+   * START, CHECKPOINT and END are written with response, the peripheral answers a CHECKPOINT
+   * only once everything before its offset has been received and stored. */
+#define BLOB_XFER_OP_START      0x01    // op, total size u32, resume offset u32
+#define BLOB_XFER_OP_DATA       0x02    // op, offset u32, payload
+#define BLOB_XFER_OP_CHECKPOINT 0x03    // op, offset u32
+#define BLOB_XFER_OP_END        0x04    // op, total size u32, crc32 u32
+
+  /* Reads len bytes at offset into dst, called from the timer task one chunk at a time */
+  typedef esp_err_t (*blob_xfer_read_t)(void* ctx, uint32_t offset, uint8_t* dst, size_t len);
+
+  typedef struct {
+    blob_xfer_read_t read;
+    void* ctx;
+    uint32_t size;
+  } blob_xfer_source_t;
+
+  /* err is ESP_OK once the peripheral confirmed END, ESP_ERR_INVALID_STATE when aborted, ESP_FAIL otherwise */
+  typedef void (*blob_xfer_done_cb_t)(const esp_bd_addr_t bda, esp_err_t err, void* arg);
+
+  esp_err_t blob_xfer_init();
+  /* Sources are read chunk by chunk while sending, nothing is copied up front.
+   * The partition or buffer must stay valid until the transfer has finished. */
+  esp_err_t blob_xfer_source_partition(const esp_partition_t* partition, uint32_t size, blob_xfer_source_t* source);
+  esp_err_t blob_xfer_source_buffer(const uint8_t* data, uint32_t size, blob_xfer_source_t* source);
+  /* One transfer per connection. Returns ESP_ERR_INVALID_STATE if one is already running on it. */
+  esp_err_t blob_xfer_start(uint16_t conn_id, uint16_t handle, const blob_xfer_source_t* source,
+    blob_xfer_done_cb_t cb, void* arg);
+  void blob_xfer_abort(uint16_t conn_id);
+  /* A transfer interrupted by a disconnect resumes from its last checkpoint once the device is back */
+  void blob_xfer_on_disconnect(uint16_t conn_id);
+  void blob_xfer_on_link_ready(uint16_t conn_id, const esp_bd_addr_t bda);
+  void display_blob_xfer_stats();
+
+
+#ifdef __cplusplus
+}
+#endif
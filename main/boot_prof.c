@@ -0,0 +1,106 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "boot_prof.h"
+
+#define TAG "BOOT"
+
+#define BOOT_PROF_MAX_PHASES 16
+
+typedef struct {
+  const char* phase;
+  int64_t time_us;
+} boot_phase_t;
+
+static boot_phase_t boot_phases[BOOT_PROF_MAX_PHASES];
+static uint32_t boot_phase_count = 0;
+static int64_t first_result_us = 0;
+
+static const char* reset_reason_name(esp_reset_reason_t reason) {
+
+  switch (reason) {
+  case ESP_RST_POWERON:
+    return "power on";
+  case ESP_RST_EXT:
+    return "external pin";
+  case ESP_RST_SW:
+    return "software";
+  case ESP_RST_PANIC:
+    return "panic";
+  case ESP_RST_INT_WDT:
+    return "interrupt watchdog";
+  case ESP_RST_TASK_WDT:
+    return "task watchdog";
+  case ESP_RST_WDT:
+    return "other watchdog";
+  case ESP_RST_DEEPSLEEP:
+    return "deep sleep";
+  case ESP_RST_BROWNOUT:
+    return "brownout";
+  case ESP_RST_SDIO:
+    return "SDIO";
+  default:
+    return "unknown";
+  }
+}
+
+void boot_prof_mark(const char* phase) {
+
+  // esp_timer starts counting early in startup, the bootloader is not included
+  int64_t now = esp_timer_get_time();
+  uint32_t idx = __atomic_fetch_add(&boot_phase_count, 1, __ATOMIC_RELAXED);
+
+  if (idx < BOOT_PROF_MAX_PHASES) {
+    boot_phases[idx].time_us = now;
+    boot_phases[idx].phase = phase;
+  }
+}
+
+void boot_prof_mark_once(const char* phase) {
+
+  uint32_t count = __atomic_load_n(&boot_phase_count, __ATOMIC_RELAXED);
+
+  for (int idx = 0; idx < count && idx < BOOT_PROF_MAX_PHASES; idx++) {
+    if (boot_phases[idx].phase != NULL && strcmp(boot_phases[idx].phase, phase) == 0) {
+      return;
+    }
+  }
+
+  boot_prof_mark(phase);
+}
+
+void boot_prof_first_result() {
+
+  if (first_result_us != 0) {
+    return;
+  }
+
+  first_result_us = esp_timer_get_time();
+  boot_prof_mark("first scan result");
+  ESP_LOGI(TAG, "First scan result %lld ms after reset", first_result_us / 1000);
+}
+
+int64_t boot_prof_first_result_us() {
+  return first_result_us;
+}
+
+void display_boot_profile() {
+
+  uint32_t count = boot_phase_count < BOOT_PROF_MAX_PHASES ? boot_phase_count : BOOT_PROF_MAX_PHASES;
+  int64_t previous_us = 0;
+
+  printf("Boot profile, reset reason: %s\n", reset_reason_name(esp_reset_reason()));
+  for (int idx = 0; idx < count; idx++) {
+    // A phase still being written by another task has no name yet
+    if (boot_phases[idx].phase == NULL) {
+      continue;
+    }
+    printf("%8lld us  +%7lld us  %s\n", boot_phases[idx].time_us, boot_phases[idx].time_us - previous_us,
+      boot_phases[idx].phase);
+    previous_us = boot_phases[idx].time_us;
+  }
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+  /* Timestamp a boot phase. phase must be a string literal, marks past the table size are ignored.
+   * Safe to call from any task. */
+  void boot_prof_mark(const char* phase);
+  /* Same for phases that recur after boot, e.g. every scan start: only the first one is marked.
+   * Not atomic, keep each phase to a single task. */
+  void boot_prof_mark_once(const char* phase);
+  /* Marks the first scan result once and logs the time since reset, cheap on every later call */
+  void boot_prof_first_result();
+  int64_t boot_prof_first_result_us();
+  void display_boot_profile();
+
+
+#ifdef __cplusplus
+}
+#endif
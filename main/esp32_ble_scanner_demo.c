@@ -32,6 +32,7 @@
 #include "esp_gatt_common_api.h"
 #include "esp_log.h"
 #include "driver/uart.h"
+#include "hal/cpu_hal.h"
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
@@ -39,6 +40,18 @@
 #include "freertos/queue.h"
 
 #include "list.h"
+#include "beacon.h"
+#include "scan_feed.h"
+#include "known_devices.h"
+#include "gattc_ops.h"
+#include "poll_sched.h"
+#include "trace.h"
+#include "boot_prof.h"
+#include "mem_budget.h"
+#include "proximity.h"
+#include "blob_xfer.h"
+#include "scan_ctrl.h"
+#include "occupancy.h"
 
 #define GATTC_TAG "GATTC_DEMO"
 #define TAG "UART_DEMO"
@@ -49,11 +62,20 @@
 #define PROFILE_A_APP_ID 0
 #define INVALID_HANDLE   0
 
+#define SCAN_NVS_NAMESPACE "scan_cfg"
+#define SCAN_NVS_KEY       "params"
+
 static const char remote_device_name[] = "LED";
+// The user's connection, opened from the menu or by the auto connect task
 static bool connect = false;
-static bool get_server = false;
-static esp_gattc_char_elem_t* char_elem_result = NULL;
-static esp_gattc_descr_elem_t* descr_elem_result = NULL;
+static esp_bd_addr_t connect_bda;
+static esp_ble_addr_type_t connect_addr_type;
+static const uint16_t notify_en = 1;
+static const uint8_t led_init_value = 0x03;
+static uint8_t led_value = 0;
+static uint32_t scan_duration = CONFIG_EXAMPLE_SCAN_DURATION;
+// Fast start: scan as soon as the stack is up, with the parameters used last time
+static bool auto_scan = false;
 
 // UART
 #define BUF_SIZE        1024
@@ -61,16 +83,32 @@ static esp_gattc_descr_elem_t* descr_elem_result = NULL;
 #define QUEUE_SIZE      20
 #define PATTERN_CHR_NUM 3
 
+#define MENU_TASK_STACK         2048
+#define AUTO_CONNECT_TASK_STACK 2048
+
 static QueueHandle_t uart0_queue;
+static TimerHandle_t scan_timer = NULL;
+
+#if CONFIG_EXAMPLE_STATIC_ALLOCATION
+static esp_gattc_char_elem_t char_elem_pool[CONFIG_EXAMPLE_MAX_CHARS];
+static esp_gattc_descr_elem_t descr_elem_pool[CONFIG_EXAMPLE_MAX_DESCRS];
+static uint8_t menu_rx_buffer[RD_BUF_SIZE];
+static StaticTimer_t scan_timer_buffer;
+static StackType_t menu_task_stack[MENU_TASK_STACK];
+static StaticTask_t menu_task_buffer;
+static StackType_t auto_connect_task_stack[AUTO_CONNECT_TASK_STACK];
+static StaticTask_t auto_connect_task_buffer;
+#endif
 
 /* Declare static functions */
 static void esp_gap_cb(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t* param);
 static void esp_gattc_cb(esp_gattc_cb_event_t event, esp_gatt_if_t gattc_if, esp_ble_gattc_cb_param_t* param);
 static void gattc_profile_event_handler(esp_gattc_cb_event_t event, esp_gatt_if_t gattc_if, esp_ble_gattc_cb_param_t* param);
+static void start_scan();
 
 /* Menu state */
 static volatile uint8_t menu_state = 0;
-struct ble_scan_result_evt_param* connected_device = NULL;
+struct ble_scan_result_evt_param connected_device;
 
 static esp_bt_uuid_t remote_filter_service_uuid = {
     .len = ESP_UUID_LEN_16,
@@ -113,16 +151,34 @@ static esp_ble_scan_params_t ble_scan_params = {
     .scan_duplicate = BLE_SCAN_DUPLICATE_DISABLE
 };
 
+/* Scan parameters as persisted in NVS */
+typedef struct {
+    esp_ble_scan_params_t params;
+    uint32_t duration;
+} scan_config_t;
+
+static scan_config_t saved_scan_config;
+
 struct gattc_profile_inst {
     esp_gattc_cb_t gattc_cb;
     uint16_t gattc_if;
     uint16_t app_id;
+};
+
+/* Per connection state, background reconnects of known devices run next to the user's link */
+typedef struct {
+    bool used;
+    bool user;
     uint16_t conn_id;
+    esp_bd_addr_t remote_bda;
+    esp_ble_addr_type_t remote_addr_type;
     uint16_t service_start_handle;
     uint16_t service_end_handle;
     uint16_t char_handle;
-    esp_bd_addr_t remote_bda;
-};
+    uint16_t blob_handle;
+} demo_link_t;
+
+static demo_link_t demo_links[CONFIG_EXAMPLE_GATTC_OPS_MAX_LINKS];
 
 
 
@@ -135,36 +191,381 @@ static struct gattc_profile_inst gl_profile_tab[PROFILE_NUM] = {
     },
 };
 
+static demo_link_t* find_demo_link(uint16_t conn_id) {
+    for (int idx = 0; idx < CONFIG_EXAMPLE_GATTC_OPS_MAX_LINKS; idx++) {
+        if (demo_links[idx].used && demo_links[idx].conn_id == conn_id) {
+            return &demo_links[idx];
+        }
+    }
+    return NULL;
+}
+
+static demo_link_t* find_user_link() {
+    for (int idx = 0; idx < CONFIG_EXAMPLE_GATTC_OPS_MAX_LINKS; idx++) {
+        if (demo_links[idx].used && demo_links[idx].user) {
+            return &demo_links[idx];
+        }
+    }
+    return NULL;
+}
+
+/* Discovery results, the static build clamps count to the pool size */
+static esp_gattc_char_elem_t* alloc_char_elems(uint16_t* count) {
+#if CONFIG_EXAMPLE_STATIC_ALLOCATION
+    if (*count > CONFIG_EXAMPLE_MAX_CHARS) {
+        *count = CONFIG_EXAMPLE_MAX_CHARS;
+    }
+    return char_elem_pool;
+#else
+    return (esp_gattc_char_elem_t*)malloc(sizeof(esp_gattc_char_elem_t) * *count);
+#endif
+}
+
+static void free_char_elems(esp_gattc_char_elem_t* elems) {
+#if !CONFIG_EXAMPLE_STATIC_ALLOCATION
+    free(elems);
+#endif
+}
+
+static esp_gattc_descr_elem_t* alloc_descr_elems(uint16_t* count) {
+#if CONFIG_EXAMPLE_STATIC_ALLOCATION
+    if (*count > CONFIG_EXAMPLE_MAX_DESCRS) {
+        *count = CONFIG_EXAMPLE_MAX_DESCRS;
+    }
+    return descr_elem_pool;
+#else
+    return (esp_gattc_descr_elem_t*)malloc(sizeof(esp_gattc_descr_elem_t) * *count);
+#endif
+}
+
+static void free_descr_elems(esp_gattc_descr_elem_t* elems) {
+#if !CONFIG_EXAMPLE_STATIC_ALLOCATION
+    free(elems);
+#endif
+}
+
+static void on_char_written(const gattc_op_result_t* result, void* arg) {
+    if (result->err != ESP_OK) {
+        ESP_LOGE(GATTC_TAG, "write char failed, error %s status = %x", esp_err_to_name(result->err), result->status);
+        return;
+    }
+    ESP_LOGI(GATTC_TAG, "write char success ");
+    ESP_LOGI(GATTC_TAG, "\n");
+}
+
+static void on_blob_sent(const esp_bd_addr_t bda, esp_err_t err, void* arg) {
+    ESP_LOGI(GATTC_TAG, "blob transfer finished: %s", esp_err_to_name(err));
+    display_blob_xfer_stats();
+}
+
+// Streams the start of the factory app straight from flash, standing in for a firmware image
+// The LED characteristic doesn't speak the blob protocol, only a dedicated one is used
+static void find_blob_char(demo_link_t* link) {
+#if CONFIG_EXAMPLE_BLOB_CHAR_UUID
+    esp_bt_uuid_t blob_char_uuid = {
+        .len = ESP_UUID_LEN_16,
+        .uuid = {.uuid16 = CONFIG_EXAMPLE_BLOB_CHAR_UUID,},
+    };
+    esp_gattc_char_elem_t char_elem;
+    uint16_t count = 1;
+
+    esp_gatt_status_t status = esp_ble_gattc_get_char_by_uuid(gl_profile_tab[PROFILE_A_APP_ID].gattc_if,
+        link->conn_id,
+        link->service_start_handle,
+        link->service_end_handle,
+        blob_char_uuid,
+        &char_elem,
+        &count);
+    if (status == ESP_GATT_OK && count > 0 &&
+        (char_elem.properties & ESP_GATT_CHAR_PROP_BIT_WRITE_NR) && (char_elem.properties & ESP_GATT_CHAR_PROP_BIT_WRITE)) {
+        link->blob_handle = char_elem.char_handle;
+        ESP_LOGI(GATTC_TAG, "blob characteristic handle %d", link->blob_handle);
+    }
+#endif
+}
+
+static void send_demo_blob(const demo_link_t* link) {
+    static blob_xfer_source_t source;
+    const esp_partition_t* partition = esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_FACTORY, NULL);
+
+    if (link->blob_handle == INVALID_HANDLE) {
+        ESP_LOGE(GATTC_TAG, "peripheral has no blob characteristic 0x%04x", CONFIG_EXAMPLE_BLOB_CHAR_UUID);
+        return;
+    }
+    if (blob_xfer_source_partition(partition, CONFIG_EXAMPLE_BLOB_DEMO_SIZE, &source) != ESP_OK) {
+        return;
+    }
+    esp_err_t ret = blob_xfer_start(link->conn_id,
+        link->blob_handle,
+        &source,
+        on_blob_sent,
+        NULL);
+    if (ret != ESP_OK) {
+        ESP_LOGE(GATTC_TAG, "blob transfer not started: %s", esp_err_to_name(ret));
+    }
+}
+
+static void on_led_polled(uint16_t conn_id, uint16_t handle, const uint8_t* value, uint16_t len, void* arg) {
+    if (value == NULL) {
+        ESP_LOGW(GATTC_TAG, "poll read of handle %d failed", handle);
+        return;
+    }
+    ESP_LOGD(GATTC_TAG, "poll read conn_id %d handle %d:", conn_id, handle);
+    esp_log_buffer_hex(GATTC_TAG, value, len);
+}
+
+static void on_cccd_written(const gattc_op_result_t* result, void* arg) {
+    if (result->err != ESP_OK) {
+        ESP_LOGE(GATTC_TAG, "write descr failed, error %s status = %x", esp_err_to_name(result->err), result->status);
+        return;
+    }
+    ESP_LOGI(GATTC_TAG, "write descr success ");
+    demo_link_t* link = find_demo_link(result->conn_id);
+    if (link == NULL) {
+        return;
+    }
+    // Notifications are on, the link is ready for use
+    known_devices_add(link->remote_bda, link->remote_addr_type);
+    known_devices_on_link_ready(link->remote_bda);
+    blob_xfer_on_link_ready(result->conn_id, link->remote_bda);
+
+#if CONFIG_EXAMPLE_POLL_LED_PERIOD_MS > 0
+    poll_sched_add(result->conn_id, link->char_handle,
+        CONFIG_EXAMPLE_POLL_LED_PERIOD_MS, on_led_polled, NULL);
+#endif
+
+    gattc_op_write_char(result->conn_id,
+        link->char_handle,
+        &led_init_value,
+        sizeof(led_init_value),
+        ESP_GATT_WRITE_TYPE_RSP,
+        on_char_written,
+        NULL);
+}
+
+static void on_notify_registered(const gattc_op_result_t* result, void* arg) {
+    ESP_LOGI(GATTC_TAG, "ESP_GATTC_REG_FOR_NOTIFY_EVT");
+    if (result->err != ESP_OK) {
+        ESP_LOGE(GATTC_TAG, "REG FOR NOTIFY failed: error status = %d", result->status);
+        return;
+    }
+    demo_link_t* link = find_demo_link(result->conn_id);
+    if (link == NULL) {
+        return;
+    }
+
+    uint16_t count = 0;
+    esp_gattc_descr_elem_t* descr_elem_result = NULL;
+    esp_gatt_status_t ret_status = esp_ble_gattc_get_attr_count(gl_profile_tab[PROFILE_A_APP_ID].gattc_if,
+        result->conn_id,
+        ESP_GATT_DB_DESCRIPTOR,
+        link->service_start_handle,
+        link->service_end_handle,
+        result->handle,
+        &count);
+    if (ret_status != ESP_GATT_OK) {
+        ESP_LOGE(GATTC_TAG, "esp_ble_gattc_get_attr_count error");
+    }
+    if (count == 0) {
+        ESP_LOGE(GATTC_TAG, "decsr not found");
+        return;
+    }
+
+    descr_elem_result = alloc_descr_elems(&count);
+    if (!descr_elem_result) {
+        ESP_LOGE(GATTC_TAG, "malloc error, gattc no mem");
+        return;
+    }
+
+    ret_status = esp_ble_gattc_get_descr_by_char_handle(gl_profile_tab[PROFILE_A_APP_ID].gattc_if,
+        result->conn_id,
+        result->handle,
+        notify_descr_uuid,
+        descr_elem_result,
+        &count);
+    if (ret_status != ESP_GATT_OK) {
+        ESP_LOGE(GATTC_TAG, "esp_ble_gattc_get_descr_by_char_handle error");
+    }
+    /* Every char has only one descriptor in our 'ESP_GATTS_DEMO' demo, so we used first 'descr_elem_result' */
+    if (count > 0 && descr_elem_result[0].uuid.len == ESP_UUID_LEN_16 && descr_elem_result[0].uuid.uuid.uuid16 == ESP_GATT_UUID_CHAR_CLIENT_CONFIG) {
+        ESP_LOGI(GATTC_TAG, "Write characteristics description");
+        if (gattc_op_write_descr(result->conn_id,
+            descr_elem_result[0].handle,
+            (const uint8_t*)&notify_en,
+            sizeof(notify_en),
+            on_cccd_written,
+            NULL) == GATTC_OP_INVALID_ID) {
+            ESP_LOGE(GATTC_TAG, "esp_ble_gattc_write_char_descr error");
+        }
+    }
+
+    /* free descr_elem_result */
+    free_descr_elems(descr_elem_result);
+}
+
+static void on_mtu_configured(const gattc_op_result_t* result, void* arg) {
+    if (result->err != ESP_OK) {
+        ESP_LOGE(GATTC_TAG, "config mtu failed, error %s status = %x", esp_err_to_name(result->err), result->status);
+    }
+    ESP_LOGI(GATTC_TAG, "MTU %d, conn_id %d", gattc_ops_get_mtu(result->conn_id), result->conn_id);
+}
+
+static void on_service_found(const gattc_op_result_t* result, void* arg) {
+    if (result->err == ESP_ERR_NOT_FOUND) {
+        ESP_LOGE(GATTC_TAG, "service 0x%x not found", REMOTE_SERVICE_UUID);
+        return;
+    }
+    if (result->err != ESP_OK) {
+        ESP_LOGE(GATTC_TAG, "search service failed, error %s status = %x", esp_err_to_name(result->err), result->status);
+        return;
+    }
+    demo_link_t* link = find_demo_link(result->conn_id);
+    if (link == NULL) {
+        return;
+    }
+    ESP_LOGI(GATTC_TAG, "service found, start handle %d end handle %d", result->handle, result->end_handle);
+    link->service_start_handle = result->handle;
+    link->service_end_handle = result->end_handle;
+    find_blob_char(link);
+
+    esp_gatt_if_t gattc_if = gl_profile_tab[PROFILE_A_APP_ID].gattc_if;
+    esp_gattc_char_elem_t* char_elem_result = NULL;
+    uint16_t count = 0;
+    esp_gatt_status_t status = esp_ble_gattc_get_attr_count(gattc_if,
+        result->conn_id,
+        ESP_GATT_DB_CHARACTERISTIC,
+        link->service_start_handle,
+        link->service_end_handle,
+        INVALID_HANDLE,
+        &count);
+    if (status != ESP_GATT_OK) {
+        ESP_LOGE(GATTC_TAG, "esp_ble_gattc_get_attr_count error");
+    }
+
+    ESP_LOGI(GATTC_TAG, "Attributes count %d", count);
+    ESP_LOGI(GATTC_TAG, "\n");
+
+    if (count > 0) {
+        char_elem_result = alloc_char_elems(&count);
+
+        status = esp_ble_gattc_get_all_char(gattc_if,
+            result->conn_id,
+            link->service_start_handle,
+            link->service_end_handle,
+            char_elem_result,
+            &count,
+            0);
+
+        for (int i = 0; i < count; i++) {
+
+            ESP_LOGI(GATTC_TAG, "Characteristics count %d. Value: ", count);
+            esp_log_buffer_hex(GATTC_TAG, char_elem_result[i].uuid.uuid.uuid128, char_elem_result[i].uuid.len);
+            ESP_LOGI(GATTC_TAG, "\n");
+        }
+
+        /* free char_elem_result */
+        free_char_elems(char_elem_result);
+    }
+
+    if (count > 0) {
+        char_elem_result = alloc_char_elems(&count);
+        if (!char_elem_result) {
+            ESP_LOGE(GATTC_TAG, "gattc no mem");
+        }
+        else {
+            status = esp_ble_gattc_get_char_by_uuid(gattc_if,
+                result->conn_id,
+                link->service_start_handle,
+                link->service_end_handle,
+                remote_filter_char_uuid,
+                char_elem_result,
+                &count);
+            if (status != ESP_GATT_OK) {
+                ESP_LOGE(GATTC_TAG, "esp_ble_gattc_get_char_by_uuid error");
+            }
+
+            ESP_LOGI(GATTC_TAG, "Properties %d", char_elem_result[0].properties);
+
+            /*  Every service have only one char in our 'ESP_GATTS_DEMO' demo, so we used first 'char_elem_result' */
+            if (count > 0 && (char_elem_result[0].properties & ESP_GATT_CHAR_PROP_BIT_NOTIFY)) {
+                link->char_handle = char_elem_result[0].char_handle;
+                gattc_op_register_notify(result->conn_id, char_elem_result[0].char_handle, on_notify_registered, NULL);
+            }
+        }
+        /* free char_elem_result */
+        free_char_elems(char_elem_result);
+    }
+    else {
+        ESP_LOGE(GATTC_TAG, "no char found");
+    }
+}
+
 static void gattc_profile_event_handler(esp_gattc_cb_event_t event, esp_gatt_if_t gattc_if, esp_ble_gattc_cb_param_t* param) {
     esp_ble_gattc_cb_param_t* p_data = (esp_ble_gattc_cb_param_t*)param;
 
     switch (event) {
     case ESP_GATTC_REG_EVT:
         ESP_LOGI(GATTC_TAG, "REG_EVT");
+        boot_prof_mark("gattc registered");
         esp_err_t scan_ret = esp_ble_gap_set_scan_params(&ble_scan_params);
         if (scan_ret) {
             ESP_LOGE(GATTC_TAG, "set scan params error, error code = %x", scan_ret);
         }
+        // With auto scan the whitelist and background connections wait until the scan is running
+        if (!auto_scan) {
+            known_devices_start(gattc_if);
+        }
         break;
     case ESP_GATTC_CONNECT_EVT: {
         ESP_LOGI(GATTC_TAG, "ESP_GATTC_CONNECT_EVT conn_id %d, if %d", p_data->connect.conn_id, gattc_if);
-        gl_profile_tab[PROFILE_A_APP_ID].conn_id = p_data->connect.conn_id;
-        memcpy(gl_profile_tab[PROFILE_A_APP_ID].remote_bda, p_data->connect.remote_bda, sizeof(esp_bd_addr_t));
         ESP_LOGI(GATTC_TAG, "REMOTE BDA:");
-        esp_log_buffer_hex(GATTC_TAG, gl_profile_tab[PROFILE_A_APP_ID].remote_bda, sizeof(esp_bd_addr_t));
-        esp_err_t mtu_ret = esp_ble_gattc_send_mtu_req(gattc_if, p_data->connect.conn_id);
-        if (mtu_ret) {
-            ESP_LOGE(GATTC_TAG, "config MTU error, error code = %x", mtu_ret);
+        esp_log_buffer_hex(GATTC_TAG, p_data->connect.remote_bda, sizeof(esp_bd_addr_t));
+        demo_link_t* link = find_demo_link(p_data->connect.conn_id);
+        for (int idx = 0; link == NULL && idx < CONFIG_EXAMPLE_GATTC_OPS_MAX_LINKS; idx++) {
+            if (!demo_links[idx].used) {
+                link = &demo_links[idx];
+            }
+        }
+        if (link == NULL) {
+            ESP_LOGE(GATTC_TAG, "no room for conn_id %d", p_data->connect.conn_id);
+            break;
+        }
+        memset(link, 0, sizeof(demo_link_t));
+        link->used = true;
+        link->conn_id = p_data->connect.conn_id;
+        memcpy(link->remote_bda, p_data->connect.remote_bda, sizeof(esp_bd_addr_t));
+        // The events carry no address type, take it from whoever opened the link
+        link->user = connect && memcmp(connect_bda, link->remote_bda, sizeof(esp_bd_addr_t)) == 0;
+        if (link->user) {
+            link->remote_addr_type = connect_addr_type;
+        }
+        else if (!known_devices_get_addr_type(link->remote_bda, &link->remote_addr_type)) {
+            link->remote_addr_type = BLE_ADDR_TYPE_PUBLIC;
+        }
+        if (gattc_op_mtu(p_data->connect.conn_id, on_mtu_configured, NULL) == GATTC_OP_INVALID_ID) {
+            ESP_LOGE(GATTC_TAG, "config MTU error");
         }
         break;
     }
-    case ESP_GATTC_OPEN_EVT:
+    case ESP_GATTC_OPEN_EVT: {
+        bool wanted = known_devices_on_open(p_data->open.remote_bda, param->open.status == ESP_GATT_OK);
         if (param->open.status != ESP_GATT_OK) {
             ESP_LOGE(GATTC_TAG, "open failed, status %d", p_data->open.status);
+            if (connect && memcmp(connect_bda, p_data->open.remote_bda, sizeof(esp_bd_addr_t)) == 0) {
+                connect = false;
+            }
+            break;
+        }
+        demo_link_t* link = find_demo_link(p_data->open.conn_id);
+        if (!wanted && (link == NULL || !link->user)) {
+            // Background open of a device removed from the menu, it completed after all
+            ESP_LOGI(GATTC_TAG, "close the link of a removed device");
+            esp_ble_gattc_close(gattc_if, p_data->open.conn_id);
             break;
         }
         ESP_LOGI(GATTC_TAG, "open success");
         break;
+    }
     case ESP_GATTC_DIS_SRVC_CMPL_EVT:
         if (param->dis_srvc_cmpl.status != ESP_GATT_OK) {
             ESP_LOGE(GATTC_TAG, "discover service failed, status %d", param->dis_srvc_cmpl.status);
@@ -172,178 +573,11 @@ static void gattc_profile_event_handler(esp_gattc_cb_event_t event, esp_gatt_if_
         }
         ESP_LOGI(GATTC_TAG, "discover service complete conn_id %d", param->dis_srvc_cmpl.conn_id);
         ESP_LOGI(GATTC_TAG, "Search service with filter 0x%x", remote_filter_service_uuid.uuid.uuid16);
-        esp_ble_gattc_search_service(gattc_if, param->cfg_mtu.conn_id, &remote_filter_service_uuid);
-
-        ESP_LOGI(GATTC_TAG, "Search all services");
-        esp_ble_gattc_search_service(gattc_if, param->cfg_mtu.conn_id, NULL);
-
-        break;
-    case ESP_GATTC_CFG_MTU_EVT:
-        if (param->cfg_mtu.status != ESP_GATT_OK) {
-            ESP_LOGE(GATTC_TAG, "config mtu failed, error status = %x", param->cfg_mtu.status);
-        }
-        ESP_LOGI(GATTC_TAG, "ESP_GATTC_CFG_MTU_EVT, Status %d, MTU %d, conn_id %d", param->cfg_mtu.status, param->cfg_mtu.mtu, param->cfg_mtu.conn_id);
-        break;
-    case ESP_GATTC_SEARCH_RES_EVT: {
-        ESP_LOGI(GATTC_TAG, "SEARCH RES: conn_id = %x is primary service %d", p_data->search_res.conn_id, p_data->search_res.is_primary);
-        ESP_LOGI(GATTC_TAG, "start handle %d end handle %d current handle value %d", p_data->search_res.start_handle, p_data->search_res.end_handle, p_data->search_res.srvc_id.inst_id);
-        ESP_LOGI(GATTC_TAG, "service uuid with length %d: 0x%x", p_data->search_res.srvc_id.uuid.len, p_data->search_res.srvc_id.uuid.uuid.uuid16);
-        if (p_data->search_res.srvc_id.uuid.len >= ESP_UUID_LEN_16 && p_data->search_res.srvc_id.uuid.uuid.uuid16 == REMOTE_SERVICE_UUID) {
-            ESP_LOGI(GATTC_TAG, "service found");
-            get_server = true;
-            gl_profile_tab[PROFILE_A_APP_ID].service_start_handle = p_data->search_res.start_handle;
-            gl_profile_tab[PROFILE_A_APP_ID].service_end_handle = p_data->search_res.end_handle;
-            ESP_LOGI(GATTC_TAG, "UUID16: %x", p_data->search_res.srvc_id.uuid.uuid.uuid16);
-        }
-        break;
-    }
-    case ESP_GATTC_SEARCH_CMPL_EVT:
-        if (p_data->search_cmpl.status != ESP_GATT_OK) {
-            ESP_LOGE(GATTC_TAG, "search service failed, error status = %x", p_data->search_cmpl.status);
-            break;
-        }
-        if (p_data->search_cmpl.searched_service_source == ESP_GATT_SERVICE_FROM_REMOTE_DEVICE) {
-            ESP_LOGI(GATTC_TAG, "Get service information from remote device");
-        }
-        else if (p_data->search_cmpl.searched_service_source == ESP_GATT_SERVICE_FROM_NVS_FLASH) {
-            ESP_LOGI(GATTC_TAG, "Get service information from flash");
-        }
-        else {
-            ESP_LOGI(GATTC_TAG, "unknown service source");
-        }
-        ESP_LOGI(GATTC_TAG, "ESP_GATTC_SEARCH_CMPL_EVT");
-        if (get_server) {
-            uint16_t count = 0;
-            uint16_t char_count = 0;
-            esp_gatt_status_t status = esp_ble_gattc_get_attr_count(gattc_if,
-                p_data->search_cmpl.conn_id,
-                ESP_GATT_DB_CHARACTERISTIC,
-                gl_profile_tab[PROFILE_A_APP_ID].service_start_handle,
-                gl_profile_tab[PROFILE_A_APP_ID].service_end_handle,
-                INVALID_HANDLE,
-                &count);
-            if (status != ESP_GATT_OK) {
-                ESP_LOGE(GATTC_TAG, "esp_ble_gattc_get_attr_count error");
-            }
-
-            ESP_LOGI(GATTC_TAG, "Attributes count %d", count);
-            ESP_LOGI(GATTC_TAG, "\n");
-
-            if (count > 0) {
-                char_elem_result = (esp_gattc_char_elem_t*)malloc(sizeof(esp_gattc_char_elem_t) * count);
-
-                status = esp_ble_gattc_get_all_char(gattc_if,
-                    p_data->search_cmpl.conn_id,
-                    gl_profile_tab[PROFILE_A_APP_ID].service_start_handle,
-                    gl_profile_tab[PROFILE_A_APP_ID].service_end_handle,
-                    char_elem_result,
-                    &count,
-                    0);
-
-                for (int i = 0; i < count; i++) {
-
-                    ESP_LOGI(GATTC_TAG, "Characteristics count %d. Value: ", count);
-                    esp_log_buffer_hex(GATTC_TAG, char_elem_result[i].uuid.uuid.uuid128, char_elem_result[i].uuid.len);
-                    ESP_LOGI(GATTC_TAG, "\n");
-                }
-
-                /* free char_elem_result */
-                free(char_elem_result);
-            }
-
-            if (count > 0) {
-                char_elem_result = (esp_gattc_char_elem_t*)malloc(sizeof(esp_gattc_char_elem_t) * count);
-                if (!char_elem_result) {
-                    ESP_LOGE(GATTC_TAG, "gattc no mem");
-                }
-                else {
-                    status = esp_ble_gattc_get_char_by_uuid(gattc_if,
-                        p_data->search_cmpl.conn_id,
-                        gl_profile_tab[PROFILE_A_APP_ID].service_start_handle,
-                        gl_profile_tab[PROFILE_A_APP_ID].service_end_handle,
-                        remote_filter_char_uuid,
-                        char_elem_result,
-                        &count);
-                    if (status != ESP_GATT_OK) {
-                        ESP_LOGE(GATTC_TAG, "esp_ble_gattc_get_char_by_uuid error");
-                    }
-
-                    ESP_LOGI(GATTC_TAG, "Properties %d", char_elem_result[0].properties);
-
-                    /*  Every service have only one char in our 'ESP_GATTS_DEMO' demo, so we used first 'char_elem_result' */
-                    if (count > 0 && (char_elem_result[0].properties & ESP_GATT_CHAR_PROP_BIT_NOTIFY)) {
-                        gl_profile_tab[PROFILE_A_APP_ID].char_handle = char_elem_result[0].char_handle;
-                        esp_ble_gattc_register_for_notify(gattc_if, gl_profile_tab[PROFILE_A_APP_ID].remote_bda, char_elem_result[0].char_handle);
-                    }
-                }
-                /* free char_elem_result */
-                free(char_elem_result);
-            }
-            else {
-                ESP_LOGE(GATTC_TAG, "no char found");
-            }
+        if (gattc_op_search_service(param->dis_srvc_cmpl.conn_id, &remote_filter_service_uuid,
+            on_service_found, NULL) == GATTC_OP_INVALID_ID) {
+            ESP_LOGE(GATTC_TAG, "search service error");
         }
         break;
-    case ESP_GATTC_REG_FOR_NOTIFY_EVT: {
-        ESP_LOGI(GATTC_TAG, "ESP_GATTC_REG_FOR_NOTIFY_EVT");
-        if (p_data->reg_for_notify.status != ESP_GATT_OK) {
-            ESP_LOGE(GATTC_TAG, "REG FOR NOTIFY failed: error status = %d", p_data->reg_for_notify.status);
-        }
-        else {
-            uint16_t count = 0;
-            uint16_t notify_en = 1;
-            esp_gatt_status_t ret_status = esp_ble_gattc_get_attr_count(gattc_if,
-                gl_profile_tab[PROFILE_A_APP_ID].conn_id,
-                ESP_GATT_DB_DESCRIPTOR,
-                gl_profile_tab[PROFILE_A_APP_ID].service_start_handle,
-                gl_profile_tab[PROFILE_A_APP_ID].service_end_handle,
-                gl_profile_tab[PROFILE_A_APP_ID].char_handle,
-                &count);
-            if (ret_status != ESP_GATT_OK) {
-                ESP_LOGE(GATTC_TAG, "esp_ble_gattc_get_attr_count error");
-            }
-            if (count > 0) {
-                descr_elem_result = malloc(sizeof(esp_gattc_descr_elem_t) * count);
-                if (!descr_elem_result) {
-                    ESP_LOGE(GATTC_TAG, "malloc error, gattc no mem");
-                }
-                else {
-                    ret_status = esp_ble_gattc_get_descr_by_char_handle(gattc_if,
-                        gl_profile_tab[PROFILE_A_APP_ID].conn_id,
-                        p_data->reg_for_notify.handle,
-                        notify_descr_uuid,
-                        descr_elem_result,
-                        &count);
-                    if (ret_status != ESP_GATT_OK) {
-                        ESP_LOGE(GATTC_TAG, "esp_ble_gattc_get_descr_by_char_handle error");
-                    }
-                    /* Every char has only one descriptor in our 'ESP_GATTS_DEMO' demo, so we used first 'descr_elem_result' */
-                    if (count > 0 && descr_elem_result[0].uuid.len == ESP_UUID_LEN_16 && descr_elem_result[0].uuid.uuid.uuid16 == ESP_GATT_UUID_CHAR_CLIENT_CONFIG) {
-                        ESP_LOGI(GATTC_TAG, "Write characteristics description");
-                        ret_status = esp_ble_gattc_write_char_descr(gattc_if,
-                            gl_profile_tab[PROFILE_A_APP_ID].conn_id,
-                            descr_elem_result[0].handle,
-                            sizeof(notify_en),
-                            (uint8_t*)&notify_en,
-                            ESP_GATT_WRITE_TYPE_RSP,
-                            ESP_GATT_AUTH_REQ_NONE);
-                    }
-
-                    if (ret_status != ESP_GATT_OK) {
-                        ESP_LOGE(GATTC_TAG, "esp_ble_gattc_write_char_descr error");
-                    }
-
-                    /* free descr_elem_result */
-                    free(descr_elem_result);
-                }
-            }
-            else {
-                ESP_LOGE(GATTC_TAG, "decsr not found");
-            }
-
-        }
-        break;
-    }
     case ESP_GATTC_NOTIFY_EVT:
         if (p_data->notify.is_notify) {
             ESP_LOGI(GATTC_TAG, "ESP_GATTC_NOTIFY_EVT, receive notify value:");
@@ -353,26 +587,6 @@ static void gattc_profile_event_handler(esp_gattc_cb_event_t event, esp_gatt_if_
         }
         esp_log_buffer_hex(GATTC_TAG, p_data->notify.value, p_data->notify.value_len);
         break;
-    case ESP_GATTC_WRITE_DESCR_EVT:
-        if (p_data->write.status != ESP_GATT_OK) {
-            ESP_LOGE(GATTC_TAG, "write descr failed, error status = %x", p_data->write.status);
-            break;
-        }
-        ESP_LOGI(GATTC_TAG, "write descr success ");
-        // uint8_t write_char_data[35];
-        uint8_t write_char_data = 0x03;
-        // for (int i = 0; i < sizeof(write_char_data); ++i)
-        // {
-        //     write_char_data[i] = i % 256;
-        // }
-        esp_ble_gattc_write_char(gattc_if,
-            gl_profile_tab[PROFILE_A_APP_ID].conn_id,
-            gl_profile_tab[PROFILE_A_APP_ID].char_handle,
-            sizeof(write_char_data),
-            &write_char_data,
-            ESP_GATT_WRITE_TYPE_RSP,
-            ESP_GATT_AUTH_REQ_NONE);
-        break;
     case ESP_GATTC_SRVC_CHG_EVT: {
         esp_bd_addr_t bda;
         memcpy(bda, p_data->srvc_chg.remote_bda, sizeof(esp_bd_addr_t));
@@ -380,34 +594,22 @@ static void gattc_profile_event_handler(esp_gattc_cb_event_t event, esp_gatt_if_
         esp_log_buffer_hex(GATTC_TAG, bda, sizeof(esp_bd_addr_t));
         break;
     }
-    case ESP_GATTC_WRITE_CHAR_EVT:
-        if (p_data->write.status != ESP_GATT_OK) {
-            ESP_LOGE(GATTC_TAG, "write char failed, error status = %x", p_data->write.status);
-            break;
+    case ESP_GATTC_DISCONNECT_EVT: {
+        demo_link_t* link = find_demo_link(p_data->disconnect.conn_id);
+        if (link != NULL) {
+            if (link->user) {
+                connect = false;
+            }
+            link->used = false;
         }
-        ESP_LOGI(GATTC_TAG, "write char success ");
-        ESP_LOGI(GATTC_TAG, "\n");
-
-        // ESP_LOGI(GATTC_TAG, "Sleeping for 10 s and then write again");
-        // vTaskDelay(10000 / portTICK_PERIOD_MS);
-
-        // uint8_t char_d = esp_random() & 0x07;
-        // ESP_LOGI(GATTC_TAG, "Write char %x", char_d);
-
-        // esp_ble_gattc_write_char(gattc_if,
-        //     gl_profile_tab[PROFILE_A_APP_ID].conn_id,
-        //     gl_profile_tab[PROFILE_A_APP_ID].char_handle,
-        //     sizeof(char_d),
-        //     &char_d,
-        //     ESP_GATT_WRITE_TYPE_RSP,
-        //     ESP_GATT_AUTH_REQ_NONE);
-
-        break;
-    case ESP_GATTC_DISCONNECT_EVT:
-        connect = false;
-        get_server = false;
+        // Let the next advert of this device go through the full path so it can be matched again
+        invalidate_scan_rest_payload(p_data->disconnect.remote_bda);
+        known_devices_on_disconnect(p_data->disconnect.remote_bda);
+        poll_sched_remove_conn(p_data->disconnect.conn_id);
+        blob_xfer_on_disconnect(p_data->disconnect.conn_id);
         ESP_LOGI(GATTC_TAG, "ESP_GATTC_DISCONNECT_EVT, reason = %d", p_data->disconnect.reason);
         break;
+    }
     default:
         ESP_LOGI(GATTC_TAG, "Default case %d\n", event);
         break;
@@ -419,11 +621,26 @@ static void esp_gap_cb(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t* par
     uint8_t adv_name_len = 0;
     switch (event) {
     case ESP_GAP_BLE_SCAN_PARAM_SET_COMPLETE_EVT: {
+#if CONFIG_EXAMPLE_SCAN_CTRL
+        // Retuned while scanning, the controller restarts the scan itself
+        if (scan_ctrl_on_params_set()) {
+            break;
+        }
+#endif
         //the unit of the duration is second
         ESP_LOGI(GATTC_TAG, "BLE_SCAN_PARAM_SET_COMPLETE_EVT: Scan params set!");
+        boot_prof_mark_once("scan params set");
+        if (auto_scan) {
+            start_scan();
+        }
         break;
     }
     case ESP_GAP_BLE_SCAN_START_COMPLETE_EVT:
+        boot_prof_mark_once("scan started");
+        if (auto_scan) {
+            auto_scan = false;
+            known_devices_start(gl_profile_tab[PROFILE_A_APP_ID].gattc_if);
+        }
         //scan start complete event to indicate scan start successfully or failed
         if (param->scan_start_cmpl.status != ESP_BT_STATUS_SUCCESS) {
             ESP_LOGE(GATTC_TAG, "scan start failed, error status = %x", param->scan_start_cmpl.status);
@@ -433,11 +650,32 @@ static void esp_gap_cb(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t* par
 
         break;
     case ESP_GAP_BLE_SCAN_RESULT_EVT: {
-        ESP_LOGI(GATTC_TAG, "ESP_GAP_BLE_SCAN_RESULT_EVT");
-
         esp_ble_gap_cb_param_t* scan_result = (esp_ble_gap_cb_param_t*)param;
+        uint32_t start_cycles = cpu_hal_get_cycle_count();
+
         switch (scan_result->scan_rst.search_evt) {
         case ESP_GAP_SEARCH_INQ_RES_EVT:
+            boot_prof_first_result();
+#if CONFIG_EXAMPLE_TRACE
+            // Record everything the radio reported, before any filtering
+            trace_record_scan_result(&(scan_result->scan_rst));
+#endif
+#if CONFIG_EXAMPLE_OCCUPANCY
+            occupancy_record(&(scan_result->scan_rst));
+#if CONFIG_EXAMPLE_OCCUPANCY_ONLY
+            // Nothing is kept per device, the sketches are all there is
+            update_scan_stats(false, cpu_hal_get_cycle_count() - start_cycles);
+            break;
+#endif
+#endif
+            // Same payload as last time, RSSI and timestamp are all that changed
+            if (update_scan_rest_if_unchanged(&(scan_result->scan_rst))) {
+                proximity_update(scan_result->scan_rst.bda, scan_result->scan_rst.rssi, PROXIMITY_TX_POWER_UNKNOWN);
+                update_scan_stats(true, cpu_hal_get_cycle_count() - start_cycles);
+                break;
+            }
+
+            ESP_LOGI(GATTC_TAG, "ESP_GAP_BLE_SCAN_RESULT_EVT");
 
             adv_name = esp_ble_resolve_adv_data(scan_result->scan_rst.ble_adv,
                 ESP_BLE_AD_TYPE_NAME_CMPL, &adv_name_len);
@@ -458,13 +696,19 @@ static void esp_gap_cb(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t* par
 
             */
 
-            if (adv_name_len > 0) {
+            beacon_record_t beacon;
+            beacon_decode(scan_result->scan_rst.ble_adv,
+                scan_result->scan_rst.adv_data_len + scan_result->scan_rst.scan_rsp_len, &beacon);
+            proximity_update(scan_result->scan_rst.bda, scan_result->scan_rst.rssi,
+                proximity_tx_power_from_adv(scan_result->scan_rst.ble_adv, &beacon));
+
+            // Beacons usually don't advertise a name, keep them if one of the decoders recognised them
+            if (adv_name_len > 0 || beacon.type != BEACON_TYPE_NONE) {
                 // esp_log_buffer_hex(GATTC_TAG, scan_result->scan_rst.bda, 6);
                 // ESP_LOGI(GATTC_TAG, "searched Adv Data Len %d, Scan Response Len %d", scan_result->scan_rst.adv_data_len, scan_result->scan_rst.scan_rsp_len);
                 // ESP_LOGI(GATTC_TAG, "searched Device Name Len %d", adv_name_len);
                 // esp_log_buffer_char(GATTC_TAG, adv_name, adv_name_len);
-                adv_name[adv_name_len - 1] = '\0';
-                add_scan_rest_to_list(&(scan_result->scan_rst), adv_name, adv_name_len);
+                add_scan_rest_to_list(&(scan_result->scan_rst), adv_name, adv_name_len, &beacon);
 
 #if CONFIG_EXAMPLE_DUMP_ADV_DATA_AND_SCAN_RESP
                 if (scan_result->scan_rst.adv_data_len > 0) {
@@ -478,20 +722,12 @@ static void esp_gap_cb(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t* par
 #endif
                 // ESP_LOGI(GATTC_TAG, "\n");
             }
-
-            // Show List of scanned bluetooth devices
-
-            if (adv_name != NULL) {
-                if (strlen(remote_device_name) == adv_name_len && strncmp((char*)adv_name, remote_device_name, adv_name_len) == 0) {
-                    ESP_LOGI(GATTC_TAG, "searched device %s\n", remote_device_name);
-                    if (connect == false) {
-                        connect = true;
-                        ESP_LOGI(GATTC_TAG, "connect to the remote device.");
-                        esp_ble_gap_stop_scanning();
-                        esp_ble_gattc_open(gl_profile_tab[PROFILE_A_APP_ID].gattc_if, scan_result->scan_rst.bda, scan_result->scan_rst.ble_addr_type, true);
-                    }
-                }
+            else {
+                // Nameless and not a beacon, skip its repeats like those of listed devices
+                ignore_scan_rest(&(scan_result->scan_rst));
             }
+
+            update_scan_stats(false, cpu_hal_get_cycle_count() - start_cycles);
             break;
         case ESP_GAP_SEARCH_INQ_CMPL_EVT:
             break;
@@ -502,6 +738,11 @@ static void esp_gap_cb(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t* par
     }
 
     case ESP_GAP_BLE_SCAN_STOP_COMPLETE_EVT:
+#if CONFIG_EXAMPLE_SCAN_CTRL
+        if (scan_ctrl_on_scan_stopped()) {
+            break;
+        }
+#endif
         if (param->scan_stop_cmpl.status != ESP_BT_STATUS_SUCCESS) {
             ESP_LOGE(GATTC_TAG, "scan stop failed, error status = %x", param->scan_stop_cmpl.status);
             break;
@@ -516,6 +757,13 @@ static void esp_gap_cb(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t* par
         }
         ESP_LOGI(GATTC_TAG, "stop adv successfully");
         break;
+    case ESP_GAP_BLE_UPDATE_WHITELIST_COMPLETE_EVT:
+        if (param->update_whitelist_cmpl.status != ESP_BT_STATUS_SUCCESS) {
+            ESP_LOGE(GATTC_TAG, "update whitelist failed, error status = %x", param->update_whitelist_cmpl.status);
+            break;
+        }
+        ESP_LOGI(GATTC_TAG, "update whitelist successfully");
+        break;
     case ESP_GAP_BLE_UPDATE_CONN_PARAMS_EVT:
         ESP_LOGI(GATTC_TAG, "update connection params status = %d, min_int = %d, max_int = %d,conn_int = %d,latency = %d, timeout = %d",
             param->update_conn_params.status,
@@ -545,6 +793,13 @@ static void esp_gattc_cb(esp_gattc_cb_event_t event, esp_gatt_if_t gattc_if, esp
         }
     }
 
+#if CONFIG_EXAMPLE_TRACE
+    trace_record_gattc_event(event, param);
+#endif
+
+    /* Complete pending async operations first, their callbacks may queue more */
+    gattc_ops_handle_event(event, gattc_if, param);
+
     /* If the gattc_if equal to profile A, call profile A cb handler,
      * so here call each profile's callback */
     do {
@@ -560,38 +815,150 @@ static void esp_gattc_cb(esp_gattc_cb_event_t event, esp_gatt_if_t gattc_if, esp
     } while (0);
 }
 
+// Which of the scanned devices the gateway is standing next to
+static void display_nearest_device() {
+    esp_bd_addr_t bda;
+    uint32_t distance_cm;
+
+    if (!proximity_nearest(bda, &distance_cm)) {
+        return;
+    }
+    printf("Nearest device %02x:%02x:%02x:%02x:%02x:%02x at %u.%02u m (%s)\n",
+        bda[0], bda[1], bda[2], bda[3], bda[4], bda[5],
+        distance_cm / 100, distance_cm % 100, proximity_zone_name(proximity_get_zone(bda)));
+}
+
 static void vTimerCallbackScanCompleted(xTimerHandle pxTimer) {
     ESP_LOGI(GATTC_TAG, "Scan is  done");
     display_scan_results();
+    display_scan_stats();
+    display_known_devices();
+    display_poll_stats();
+    display_proximity();
+    display_nearest_device();
+#if CONFIG_EXAMPLE_SCAN_CTRL
+    display_scan_ctrl_stats();
+#endif
+#if CONFIG_EXAMPLE_OCCUPANCY
+    display_occupancy();
+#endif
+#if CONFIG_EXAMPLE_TRACE
+    display_trace_stats();
+#endif
+    display_boot_profile();
     menu_state = 1;
 }
 
+static void start_scan() {
+    ESP_LOGI(GATTC_TAG, "Start scanning");
+    esp_ble_gap_start_scanning(scan_duration);
+#if CONFIG_EXAMPLE_SCAN_CTRL
+    scan_ctrl_on_scan_started(&ble_scan_params, scan_duration);
+#endif
+
+    // Notify when scanning is over, changing the period also (re)starts the timer
+    if (xTimerChangePeriod(scan_timer, pdMS_TO_TICKS(scan_duration * 1000 + 5000), 0) != pdPASS) {
+        ESP_LOGE(GATTC_TAG, "Unable to start timer.");
+    }
+}
+
+// Returns true if parameters from an earlier scan were found
+static bool load_scan_config() {
+    nvs_handle_t nvs;
+    size_t len = sizeof(saved_scan_config);
+
+    if (nvs_open(SCAN_NVS_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK) {
+        return false;
+    }
+    // A blob of another size was written by a different firmware, ignore it
+    esp_err_t ret = nvs_get_blob(nvs, SCAN_NVS_KEY, &saved_scan_config, &len);
+    nvs_close(nvs);
+    if (ret != ESP_OK || len != sizeof(saved_scan_config)) {
+        memset(&saved_scan_config, 0, sizeof(saved_scan_config));
+        return false;
+    }
+
+    ble_scan_params = saved_scan_config.params;
+    scan_duration = saved_scan_config.duration;
+    return true;
+}
+
+// Only writes when the parameters differ from the stored ones
+static void save_scan_config() {
+    scan_config_t config = {
+        .params = ble_scan_params,
+        .duration = scan_duration,
+    };
+    nvs_handle_t nvs;
+
+    if (memcmp(&config, &saved_scan_config, sizeof(config)) == 0) {
+        return;
+    }
+
+    esp_err_t ret = nvs_open(SCAN_NVS_NAMESPACE, NVS_READWRITE, &nvs);
+    if (ret == ESP_OK) {
+        ret = nvs_set_blob(nvs, SCAN_NVS_KEY, &config, sizeof(config));
+        if (ret == ESP_OK) {
+            ret = nvs_commit(nvs);
+        }
+        nvs_close(nvs);
+    }
+    if (ret != ESP_OK) {
+        ESP_LOGE(GATTC_TAG, "save scan params failed: %s", esp_err_to_name(ret));
+        return;
+    }
+    saved_scan_config = config;
+}
+
+// Connects to the remote device as soon as the scan store reports it
+static void auto_connect_task(void* pvParameter) {
+    scan_feed_filter_t filter = {
+        .events = SCAN_FEED_DEVICE_ADDED | SCAN_FEED_PAYLOAD_CHANGED,
+        .min_rssi = -127,
+        .beacons_only = false,
+        .name = remote_device_name,
+    };
+    scan_feed_batch_t batch;
+
+    QueueHandle_t feed = scan_feed_subscribe(&filter);
+    if (feed == NULL) {
+        vTaskDelete(NULL);
+        return;
+    }
+
+    while (1) {
+        if (xQueueReceive(feed, &batch, portMAX_DELAY)) {
+            for (int idx = 0; idx < batch.count; idx++) {
+                // Known devices are reconnected by their background open, a second open would race it
+                if (known_devices_contains(batch.entries[idx].bda)) {
+                    continue;
+                }
+                if (connect == false) {
+                    memcpy(connect_bda, batch.entries[idx].bda, sizeof(esp_bd_addr_t));
+                    connect_addr_type = batch.entries[idx].addr_type;
+                    connect = true;
+                    ESP_LOGI(GATTC_TAG, "searched device %s\n", remote_device_name);
+                    ESP_LOGI(GATTC_TAG, "connect to the remote device.");
+#if CONFIG_EXAMPLE_SCAN_CTRL
+                    scan_ctrl_stop();
+#else
+                    esp_ble_gap_stop_scanning();
+#endif
+                    esp_ble_gattc_open(gl_profile_tab[PROFILE_A_APP_ID].gattc_if, batch.entries[idx].bda, batch.entries[idx].addr_type, true);
+                }
+            }
+        }
+    }
+}
+
 static void handle_user_input(const char* input, const uint8_t* tmp) {
     ESP_LOGI(TAG, "I am receiving user input: %s %x %d", input, tmp[0], menu_state);
 
     if (menu_state == 0) {
         if (input[0] == '1') {
             // Start scanning
-            ESP_LOGI(GATTC_TAG, "Start scanning");
-            uint32_t duration = 30;
-            esp_ble_gap_start_scanning(duration);
-
-            // Create timer callback to notify if scanning is over.
-            TimerHandle_t timerHandle;
-            timerHandle = xTimerCreate(
-                "BLEScanTimer",
-                pdMS_TO_TICKS(35000),
-                pdFALSE, // auto reload
-                (void*)0,
-                vTimerCallbackScanCompleted
-            );
-            if (timerHandle == NULL) {
-                ESP_LOGE(GATTC_TAG, "Unable to create timer.");
-            }
-
-            if (xTimerStart(timerHandle, 0) != pdPASS) {
-                ESP_LOGE(GATTC_TAG, "Unable to start timer.");
-            }
+            save_scan_config();
+            start_scan();
         }
         else {
             // Do nothing
@@ -599,17 +966,17 @@ static void handle_user_input(const char* input, const uint8_t* tmp) {
     }
     else if (menu_state == 1) {
 
-        struct ble_scan_result_evt_param* result = NULL;
-
-        find_device_by_index(input[0] - '0', &result);
+        struct ble_scan_result_evt_param result;
 
-        if (result != NULL) {
+        if (find_device_by_index(input[0] - '0', &result)) {
             if (connect == false) {
                 ESP_LOGI(GATTC_TAG, "connect to the remote device.");
+                memcpy(connect_bda, result.bda, sizeof(esp_bd_addr_t));
+                connect_addr_type = result.ble_addr_type;
                 connect = true;
                 esp_ble_gattc_open(gl_profile_tab[PROFILE_A_APP_ID].gattc_if,
-                    result->bda,
-                    result->ble_addr_type,
+                    result.bda,
+                    result.ble_addr_type,
                     true);
                 menu_state = 2;
                 connected_device = result;
@@ -620,38 +987,84 @@ static void handle_user_input(const char* input, const uint8_t* tmp) {
         }
     }
     else if (menu_state == 2) {
+        demo_link_t* link = find_user_link();
+
         if (input[0] == '9') {
             ESP_LOGI(GATTC_TAG, "Disconnect remote device.");
-            esp_ble_gap_disconnect(connected_device->bda);
+            // Explicit disconnect, stop reconnecting to it
+            known_devices_remove(connected_device.bda);
+            if (link != NULL) {
+                blob_xfer_abort(link->conn_id);
+            }
+            esp_ble_gap_disconnect(connected_device.bda);
             menu_state = 1;
 
             display_scan_results();
         }
+        else if (input[0] == 't') {
+            display_blob_xfer_stats();
+        }
+        else if (link == NULL || link->char_handle == INVALID_HANDLE) {
+            ESP_LOGI(GATTC_TAG, "Not connected yet");
+        }
+        else if (input[0] == 'b') {
+            send_demo_blob(link);
+        }
         else {
             // Set the LED value
             ESP_LOGI(GATTC_TAG, "Write char %x", input[0]);
-            uint8_t char_d = input[0] - '0';
-
-            esp_ble_gattc_write_char(
-                gl_profile_tab[PROFILE_A_APP_ID].gattc_if,
-                gl_profile_tab[PROFILE_A_APP_ID].conn_id,
-                gl_profile_tab[PROFILE_A_APP_ID].char_handle,
-                sizeof(char_d),
-                &char_d,
+            led_value = input[0] - '0';
+
+            gattc_op_write_char(
+                link->conn_id,
+                link->char_handle,
+                &led_value,
+                sizeof(led_value),
                 ESP_GATT_WRITE_TYPE_RSP,
-                ESP_GATT_AUTH_REQ_NONE);
+                on_char_written,
+                NULL);
 
         }
     }
 }
 
+static void console_init() {
+    // Setting UART Communication
+    ESP_LOGI(TAG, "Setting UART Communication");
+    uart_config_t uart_config = {
+        .baud_rate = 115200,
+        .data_bits = UART_DATA_8_BITS,
+        .parity = UART_PARITY_DISABLE,
+        .stop_bits = UART_STOP_BITS_1,
+        .flow_ctrl = UART_HW_FLOWCTRL_DISABLE,
+        .source_clk = UART_SCLK_APB,
+    };
+    // Install UART driver
+    uart_driver_install(UART_NUM_0, BUF_SIZE, BUF_SIZE, QUEUE_SIZE, &uart0_queue, 0);
+    uart_param_config(UART_NUM_0, &uart_config);
+
+    uart_set_pin(UART_NUM_0, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE);
+
+    uart_enable_pattern_det_baud_intr(UART_NUM_0, '+', 3, 9, 0, 0);
+    uart_pattern_queue_reset(UART_NUM_0, 20);
+    boot_prof_mark("console ready");
+}
+
 // Main menu task
 void main_menu_task(void* pvParameter) {
+#if CONFIG_EXAMPLE_FAST_START
+    // Runs in parallel with the BT bring-up in app_main
+    console_init();
+#endif
     printf("ESP32 BLE Scanner Demo\n");
 
     uart_event_t event;
     size_t buffered_size;
+#if CONFIG_EXAMPLE_STATIC_ALLOCATION
+    uint8_t* dtmp = menu_rx_buffer;
+#else
     uint8_t* dtmp = (uint8_t*)malloc(RD_BUF_SIZE);
+#endif
 
     while (1) {
         if (xQueueReceive(uart0_queue, (void*)&event, (portTickType)portMAX_DELAY)) {
@@ -728,6 +1141,7 @@ void main_menu_task(void* pvParameter) {
 }
 
 void app_main(void) {
+    boot_prof_mark("app_main");
     // Initialize NVS. (ESP32 modules run code from an external flash).
     esp_err_t ret = nvs_flash_init();
     if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND) {
@@ -736,28 +1150,77 @@ void app_main(void) {
     }
 
     ESP_ERROR_CHECK(ret);
+    boot_prof_mark("nvs ready");
 
-    // Setting UART Communication
-    ESP_LOGI(TAG, "Setting UART Communication");
-    uart_config_t uart_config = {
-        .baud_rate = 115200,
-        .data_bits = UART_DATA_8_BITS,
-        .parity = UART_PARITY_DISABLE,
-        .stop_bits = UART_STOP_BITS_1,
-        .flow_ctrl = UART_HW_FLOWCTRL_DISABLE,
-        .source_clk = UART_SCLK_APB,
-    };
-    // Install UART driver
-    uart_driver_install(UART_NUM_0, BUF_SIZE, BUF_SIZE, QUEUE_SIZE, &uart0_queue, 0);
-    uart_param_config(UART_NUM_0, &uart_config);
+    // Parameters of the last scan, fast start scans with them right away
+    if (load_scan_config()) {
+#if CONFIG_EXAMPLE_FAST_START_AUTO_SCAN
+        auto_scan = true;
+#endif
+    }
 
-    uart_set_pin(UART_NUM_0, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE);
+    ESP_ERROR_CHECK(scan_list_init());
+    ESP_ERROR_CHECK(scan_feed_init());
+    ESP_ERROR_CHECK(known_devices_init());
+    ESP_ERROR_CHECK(gattc_ops_init());
+    ESP_ERROR_CHECK(poll_sched_init());
+    ESP_ERROR_CHECK(proximity_init());
+    ESP_ERROR_CHECK(blob_xfer_init());
+#if CONFIG_EXAMPLE_SCAN_CTRL
+    ESP_ERROR_CHECK(scan_ctrl_init());
+#endif
+#if CONFIG_EXAMPLE_OCCUPANCY
+    ESP_ERROR_CHECK(occupancy_init());
+#endif
+#if CONFIG_EXAMPLE_TRACE
+    // A diagnostic, scan without it rather than abort, e.g. with no trace partition
+    if (trace_init() != ESP_OK) {
+        ESP_LOGE(GATTC_TAG, "trace disabled");
+    }
+#endif
 
-    uart_enable_pattern_det_baud_intr(UART_NUM_0, '+', 3, 9, 0, 0);
-    uart_pattern_queue_reset(UART_NUM_0, 20);
+    // Created once, every scan restarts it
+#if CONFIG_EXAMPLE_STATIC_ALLOCATION
+    scan_timer = xTimerCreateStatic(
+        "BLEScanTimer",
+        pdMS_TO_TICKS(35000),
+        pdFALSE, // auto reload
+        (void*)0,
+        vTimerCallbackScanCompleted,
+        &scan_timer_buffer
+    );
+#else
+    scan_timer = xTimerCreate(
+        "BLEScanTimer",
+        pdMS_TO_TICKS(35000),
+        pdFALSE, // auto reload
+        (void*)0,
+        vTimerCallbackScanCompleted
+    );
+#endif
+    if (scan_timer == NULL) {
+        ESP_LOGE(GATTC_TAG, "Unable to create timer.");
+        return;
+    }
+    boot_prof_mark("modules ready");
+
+#if !CONFIG_EXAMPLE_FAST_START
+    console_init();
+#endif
 
     // Create a task waiting for user input
-    xTaskCreate(&main_menu_task, "main_menu", 2048, NULL, 5, NULL);
+#if CONFIG_EXAMPLE_STATIC_ALLOCATION
+    xTaskCreateStatic(&main_menu_task, "main_menu", MENU_TASK_STACK, NULL, 5,
+        menu_task_stack, &menu_task_buffer);
+    xTaskCreateStatic(&auto_connect_task, "auto_connect", AUTO_CONNECT_TASK_STACK, NULL, 5,
+        auto_connect_task_stack, &auto_connect_task_buffer);
+    mem_budget_add("demo", sizeof(demo_links) + sizeof(char_elem_pool) + sizeof(descr_elem_pool) + sizeof(menu_rx_buffer) +
+        sizeof(scan_timer_buffer) + sizeof(menu_task_stack) + sizeof(menu_task_buffer) +
+        sizeof(auto_connect_task_stack) + sizeof(auto_connect_task_buffer));
+#else
+    xTaskCreate(&main_menu_task, "main_menu", MENU_TASK_STACK, NULL, 5, NULL);
+    xTaskCreate(&auto_connect_task, "auto_connect", AUTO_CONNECT_TASK_STACK, NULL, 5, NULL);
+#endif
 
     ESP_ERROR_CHECK(esp_bt_controller_mem_release(ESP_BT_MODE_CLASSIC_BT));
 
@@ -773,6 +1236,7 @@ void app_main(void) {
         ESP_LOGE(GATTC_TAG, "%s enable controller failed: %s\n", __func__, esp_err_to_name(ret));
         return;
     }
+    boot_prof_mark("bt controller ready");
 
     ret = esp_bluedroid_init();
     if (ret) {
@@ -786,6 +1250,7 @@ void app_main(void) {
         ESP_LOGE(GATTC_TAG, "%s enable bluetooth failed: %s\n", __func__, esp_err_to_name(ret));
         return;
     }
+    boot_prof_mark("bluedroid ready");
 
     //register the  callback function to the gap module
     ret = esp_ble_gap_register_callback(esp_gap_cb);
@@ -810,5 +1275,7 @@ void app_main(void) {
         ESP_LOGE(GATTC_TAG, "set local  MTU failed, error code = %x", local_mtu_ret);
     }
 
+    display_memory_budget();
+
 }
 
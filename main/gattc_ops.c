@@ -0,0 +1,593 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/timers.h"
+#include "gattc_ops.h"
+#include "mem_budget.h"
+
+#define TAG "GATTC_OPS"
+
+#define DEFAULT_MTU         23
+#define TIMEOUT_CHECK_MS    100
+
+typedef enum {
+  OP_FREE = 0,
+  OP_QUEUED,
+  OP_IN_FLIGHT,
+  OP_TIMED_OUT,             // reported, but the stack still owes its response
+} gattc_op_state_t;
+
+typedef struct {
+  gattc_op_state_t state;
+  uint32_t id;
+  gattc_op_type_t type;
+  uint16_t conn_id;
+  uint16_t handle;           // service start handle for searches, set by SEARCH_RES
+  uint16_t end_handle;
+  esp_bt_uuid_t uuid;
+  const uint8_t* value;
+  uint16_t value_len;
+  esp_gatt_write_type_t write_type;
+  gattc_op_cb_t cb;
+  void* arg;
+  TickType_t deadline;
+} gattc_op_t;
+
+typedef struct {
+  bool used;
+  bool issuing;             // a task is handing the link's operations to the stack
+  uint16_t conn_id;
+  esp_bd_addr_t remote_bda;
+  uint16_t mtu;
+  uint8_t in_flight;
+} gattc_link_t;
+
+/* Completions are collected under the lock and run after it is released,
+ * so callbacks can submit follow-up operations */
+typedef struct {
+  gattc_op_cb_t cb;
+  void* arg;
+  gattc_op_result_t result;
+} gattc_op_completion_t;
+
+typedef struct {
+  uint8_t count;
+  gattc_op_completion_t entries[CONFIG_EXAMPLE_GATTC_OPS_MAX];
+} gattc_op_completions_t;
+
+static gattc_op_t ops[CONFIG_EXAMPLE_GATTC_OPS_MAX];
+static gattc_link_t links[CONFIG_EXAMPLE_GATTC_OPS_MAX_LINKS];
+static esp_gatt_if_t ops_gattc_if = ESP_GATT_IF_NONE;
+static uint32_t next_id = 1;
+static SemaphoreHandle_t ops_lock = NULL;
+static TimerHandle_t timeout_timer = NULL;
+#if CONFIG_EXAMPLE_STATIC_ALLOCATION
+static StaticSemaphore_t ops_lock_buffer;
+static StaticTimer_t timeout_timer_buffer;
+#endif
+
+static gattc_link_t* find_link(uint16_t conn_id) {
+
+  for (int idx = 0; idx < CONFIG_EXAMPLE_GATTC_OPS_MAX_LINKS; idx++) {
+    if (links[idx].used && links[idx].conn_id == conn_id) {
+      return &links[idx];
+    }
+  }
+
+  return NULL;
+}
+
+static void complete_op(gattc_op_t* op, esp_err_t err, esp_gatt_status_t status,
+  const uint8_t* value, uint16_t value_len, gattc_op_completions_t* done) {
+
+  if (op->state == OP_IN_FLIGHT) {
+    gattc_link_t* link = find_link(op->conn_id);
+    if (link != NULL && link->in_flight > 0) {
+      link->in_flight--;
+    }
+  }
+
+  if (op->cb != NULL) {
+    gattc_op_completion_t* completion = &done->entries[done->count++];
+    completion->cb = op->cb;
+    completion->arg = op->arg;
+    completion->result.id = op->id;
+    completion->result.type = op->type;
+    completion->result.err = err;
+    completion->result.status = status;
+    completion->result.conn_id = op->conn_id;
+    completion->result.handle = op->handle;
+    completion->result.end_handle = op->end_handle;
+    completion->result.value = value;
+    completion->result.value_len = value_len;
+  }
+
+  op->state = OP_FREE;
+}
+
+static void run_completions(gattc_op_completions_t* done) {
+
+  for (int idx = 0; idx < done->count; idx++) {
+    done->entries[idx].cb(&done->entries[idx].result, done->entries[idx].arg);
+  }
+}
+
+static esp_err_t issue_op(gattc_op_t* op, esp_bd_addr_t remote_bda) {
+
+  switch (op->type) {
+  case GATTC_OP_MTU:
+    return esp_ble_gattc_send_mtu_req(ops_gattc_if, op->conn_id);
+  case GATTC_OP_SEARCH_SERVICE:
+    return esp_ble_gattc_search_service(ops_gattc_if, op->conn_id, &op->uuid);
+  case GATTC_OP_READ_CHAR:
+    return esp_ble_gattc_read_char(ops_gattc_if, op->conn_id, op->handle, ESP_GATT_AUTH_REQ_NONE);
+  case GATTC_OP_WRITE_CHAR:
+    return esp_ble_gattc_write_char(ops_gattc_if, op->conn_id, op->handle, op->value_len,
+      (uint8_t*)op->value, op->write_type, ESP_GATT_AUTH_REQ_NONE);
+  case GATTC_OP_READ_DESCR:
+    return esp_ble_gattc_read_char_descr(ops_gattc_if, op->conn_id, op->handle, ESP_GATT_AUTH_REQ_NONE);
+  case GATTC_OP_WRITE_DESCR:
+    return esp_ble_gattc_write_char_descr(ops_gattc_if, op->conn_id, op->handle, op->value_len,
+      (uint8_t*)op->value, ESP_GATT_WRITE_TYPE_RSP, ESP_GATT_AUTH_REQ_NONE);
+  case GATTC_OP_REG_NOTIFY:
+    return esp_ble_gattc_register_for_notify(ops_gattc_if, remote_bda, op->handle);
+  default:
+    return ESP_ERR_INVALID_ARG;
+  }
+}
+
+// MTU exchanges and service searches are matched on the link alone
+static bool op_has_handle(gattc_op_type_t type) {
+  return type != GATTC_OP_MTU && type != GATTC_OP_SEARCH_SERVICE;
+}
+
+static bool uuid_equal(const esp_bt_uuid_t* a, const esp_bt_uuid_t* b) {
+
+  if (a->len != b->len) {
+    return false;
+  }
+
+  switch (a->len) {
+  case ESP_UUID_LEN_16:
+    return a->uuid.uuid16 == b->uuid.uuid16;
+  case ESP_UUID_LEN_32:
+    return a->uuid.uuid32 == b->uuid.uuid32;
+  default:
+    return memcmp(a->uuid.uuid128, b->uuid.uuid128, ESP_UUID_LEN_128) == 0;
+  }
+}
+
+/* A timed out operation still owns the late response of the stack, so it is matched as in flight.
+ * Otherwise that response would complete the next operation on the same handle. The ATT timeout
+ * of the stack drops the link if the response never comes, which frees it. */
+static bool state_matches(gattc_op_state_t op_state, gattc_op_state_t state) {
+  return op_state == state || (state == OP_IN_FLIGHT && op_state == OP_TIMED_OUT);
+}
+
+// Oldest queued or in flight operation of a link, optionally matching type and handle
+static gattc_op_t* find_oldest_op(gattc_op_state_t state, uint16_t conn_id, bool any_conn,
+  bool match_type, gattc_op_type_t type, uint16_t handle) {
+
+  gattc_op_t* oldest = NULL;
+
+  for (int idx = 0; idx < CONFIG_EXAMPLE_GATTC_OPS_MAX; idx++) {
+    gattc_op_t* op = &ops[idx];
+
+    if (!state_matches(op->state, state) || (!any_conn && op->conn_id != conn_id)) {
+      continue;
+    }
+    if (match_type && (op->type != type || (op_has_handle(type) && op->handle != handle))) {
+      continue;
+    }
+    if (oldest == NULL || (int32_t)(op->id - oldest->id) < 0) {
+      oldest = op;
+    }
+  }
+
+  return oldest;
+}
+
+static gattc_op_t* find_op_by_id(uint32_t id) {
+
+  for (int idx = 0; idx < CONFIG_EXAMPLE_GATTC_OPS_MAX; idx++) {
+    if (ops[idx].state != OP_FREE && ops[idx].id == id) {
+      return &ops[idx];
+    }
+  }
+
+  return NULL;
+}
+
+/* Hand queued operations of a link to the stack until its pipeline is full.
+ * Called without the lock: the esp_ble_gattc calls can block on the BTC queue while
+ * the BTC task waits for the lock in gattc_ops_handle_event. The operations are picked
+ * under the lock, issued after it is released, and one task at a time issues per link
+ * so they reach the stack in order. */
+static void pump_link(uint16_t conn_id) {
+
+  gattc_op_t batch[CONFIG_EXAMPLE_GATTC_OPS_PIPELINE_DEPTH];
+  esp_bd_addr_t remote_bda;
+  uint8_t count;
+
+  do {
+    gattc_op_completions_t done = { .count = 0 };
+    count = 0;
+
+    xSemaphoreTake(ops_lock, portMAX_DELAY);
+    gattc_link_t* link = find_link(conn_id);
+    if (link == NULL || link->issuing) {
+      // Gone, or the task issuing for it picks up the new operations when it loops
+      xSemaphoreGive(ops_lock);
+      return;
+    }
+    while (link->in_flight < CONFIG_EXAMPLE_GATTC_OPS_PIPELINE_DEPTH) {
+      gattc_op_t* op = find_oldest_op(OP_QUEUED, conn_id, false, false, 0, 0);
+      if (op == NULL) {
+        break;
+      }
+
+      op->state = OP_IN_FLIGHT;
+      op->deadline = xTaskGetTickCount() + pdMS_TO_TICKS(CONFIG_EXAMPLE_GATTC_OPS_TIMEOUT_MS);
+      link->in_flight++;
+      batch[count++] = *op;
+    }
+    link->issuing = count > 0;
+    memcpy(remote_bda, link->remote_bda, sizeof(esp_bd_addr_t));
+    xSemaphoreGive(ops_lock);
+
+    for (int idx = 0; idx < count; idx++) {
+      esp_err_t ret = issue_op(&batch[idx], remote_bda);
+      if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "op %d issue error, error code = %x", batch[idx].id, ret);
+
+        xSemaphoreTake(ops_lock, portMAX_DELAY);
+        // A disconnect may have completed it meanwhile
+        gattc_op_t* op = find_op_by_id(batch[idx].id);
+        if (op != NULL && op->state == OP_IN_FLIGHT) {
+          complete_op(op, ret, ESP_GATT_ERROR, NULL, 0, &done);
+        }
+        else if (op != NULL && op->state == OP_TIMED_OUT) {
+          // Never reached the stack, no response will free it
+          op->state = OP_FREE;
+        }
+        xSemaphoreGive(ops_lock);
+      }
+    }
+
+    if (count > 0) {
+      xSemaphoreTake(ops_lock, portMAX_DELAY);
+      link = find_link(conn_id);
+      if (link != NULL) {
+        link->issuing = false;
+      }
+      xSemaphoreGive(ops_lock);
+    }
+
+    run_completions(&done);
+  } while (count > 0);
+}
+
+static uint32_t submit_op(gattc_op_type_t type, uint16_t conn_id, uint16_t handle, const esp_bt_uuid_t* uuid,
+  const uint8_t* value, uint16_t value_len, esp_gatt_write_type_t write_type, gattc_op_cb_t cb, void* arg) {
+
+  uint32_t id = GATTC_OP_INVALID_ID;
+
+  if (ops_lock == NULL) {
+    return GATTC_OP_INVALID_ID;
+  }
+
+  xSemaphoreTake(ops_lock, portMAX_DELAY);
+
+  gattc_link_t* link = find_link(conn_id);
+  if (link == NULL) {
+    ESP_LOGE(TAG, "%s: No link with conn_id %d", __func__, conn_id);
+  }
+  else {
+    for (int idx = 0; idx < CONFIG_EXAMPLE_GATTC_OPS_MAX; idx++) {
+      gattc_op_t* op = &ops[idx];
+
+      if (op->state == OP_FREE) {
+        id = next_id++;
+        if (next_id == GATTC_OP_INVALID_ID) {
+          next_id++;
+        }
+
+        op->state = OP_QUEUED;
+        op->id = id;
+        op->type = type;
+        op->conn_id = conn_id;
+        op->handle = handle;
+        op->end_handle = 0;
+        if (uuid != NULL) {
+          op->uuid = *uuid;
+        }
+        op->value = value;
+        op->value_len = value_len;
+        op->write_type = write_type;
+        op->cb = cb;
+        op->arg = arg;
+        break;
+      }
+    }
+
+    if (id == GATTC_OP_INVALID_ID) {
+      ESP_LOGE(TAG, "%s: Operation table full", __func__);
+    }
+  }
+
+  xSemaphoreGive(ops_lock);
+
+  if (id != GATTC_OP_INVALID_ID) {
+    pump_link(conn_id);
+  }
+
+  return id;
+}
+
+static void vTimerCallbackTimeout(TimerHandle_t pxTimer) {
+
+  gattc_op_completions_t done = { .count = 0 };
+  uint16_t pump[CONFIG_EXAMPLE_GATTC_OPS_MAX_LINKS];
+  uint8_t pump_count = 0;
+  TickType_t now = xTaskGetTickCount();
+
+  xSemaphoreTake(ops_lock, portMAX_DELAY);
+  for (int idx = 0; idx < CONFIG_EXAMPLE_GATTC_OPS_MAX; idx++) {
+    gattc_op_t* op = &ops[idx];
+
+    if (op->state == OP_IN_FLIGHT && (int32_t)(now - op->deadline) >= 0) {
+      ESP_LOGW(TAG, "op %d timed out", op->id);
+      complete_op(op, ESP_ERR_TIMEOUT, ESP_GATT_ERROR, NULL, 0, &done);
+      op->state = OP_TIMED_OUT;
+    }
+  }
+  // Timed out operations made room in the pipeline of their links
+  for (int idx = 0; idx < CONFIG_EXAMPLE_GATTC_OPS_MAX_LINKS; idx++) {
+    if (links[idx].used && links[idx].in_flight < CONFIG_EXAMPLE_GATTC_OPS_PIPELINE_DEPTH) {
+      pump[pump_count++] = links[idx].conn_id;
+    }
+  }
+  xSemaphoreGive(ops_lock);
+
+  run_completions(&done);
+  for (int idx = 0; idx < pump_count; idx++) {
+    pump_link(pump[idx]);
+  }
+}
+
+esp_err_t gattc_ops_init() {
+
+#if CONFIG_EXAMPLE_STATIC_ALLOCATION
+  ops_lock = xSemaphoreCreateMutexStatic(&ops_lock_buffer);
+#else
+  ops_lock = xSemaphoreCreateMutex();
+#endif
+  if (ops_lock == NULL) {
+    ESP_LOGE(TAG, "%s: Unable to create lock", __func__);
+    return ESP_ERR_NO_MEM;
+  }
+
+#if CONFIG_EXAMPLE_STATIC_ALLOCATION
+  timeout_timer = xTimerCreateStatic(
+    "GattcOpsTimeout",
+    pdMS_TO_TICKS(TIMEOUT_CHECK_MS),
+    pdTRUE, // auto reload
+    (void*)0,
+    vTimerCallbackTimeout,
+    &timeout_timer_buffer
+  );
+  mem_budget_add("gattc_ops", sizeof(ops) + sizeof(links) + sizeof(ops_lock_buffer) + sizeof(timeout_timer_buffer));
+#else
+  timeout_timer = xTimerCreate(
+    "GattcOpsTimeout",
+    pdMS_TO_TICKS(TIMEOUT_CHECK_MS),
+    pdTRUE, // auto reload
+    (void*)0,
+    vTimerCallbackTimeout
+  );
+  mem_budget_add("gattc_ops", sizeof(ops) + sizeof(links));
+#endif
+  if (timeout_timer == NULL || xTimerStart(timeout_timer, 0) != pdPASS) {
+    ESP_LOGE(TAG, "%s: Unable to start timeout timer", __func__);
+    return ESP_FAIL;
+  }
+
+  return ESP_OK;
+}
+
+// Returns true with the link to pump in pump_conn_id when an operation completed
+static bool handle_completion(gattc_op_type_t type, uint16_t conn_id, bool any_conn, uint16_t handle,
+  esp_gatt_status_t status, const uint8_t* value, uint16_t value_len, gattc_op_completions_t* done,
+  uint16_t* pump_conn_id) {
+
+  gattc_op_t* op = find_oldest_op(OP_IN_FLIGHT, conn_id, any_conn, true, type, handle);
+
+  if (op == NULL) {
+    // Issued directly through the esp_ble_gattc API
+    return false;
+  }
+  if (op->state == OP_TIMED_OUT) {
+    // Already reported, the late response only frees it
+    ESP_LOGW(TAG, "op %d completed after its timeout", op->id);
+    op->state = OP_FREE;
+    return false;
+  }
+
+  esp_err_t err = status == ESP_GATT_OK ? ESP_OK : ESP_FAIL;
+  if (err == ESP_OK && type == GATTC_OP_SEARCH_SERVICE && op->handle == 0) {
+    err = ESP_ERR_NOT_FOUND;
+  }
+
+  *pump_conn_id = op->conn_id;
+  complete_op(op, err, status, value, value_len, done);
+
+  return true;
+}
+
+void gattc_ops_handle_event(esp_gattc_cb_event_t event, esp_gatt_if_t gattc_if, esp_ble_gattc_cb_param_t* param) {
+
+  gattc_op_completions_t done = { .count = 0 };
+  uint16_t pump_conn_id = 0;
+  bool pump = false;
+
+  if (ops_lock == NULL) {
+    return;
+  }
+
+  xSemaphoreTake(ops_lock, portMAX_DELAY);
+
+  if (gattc_if != ESP_GATT_IF_NONE) {
+    ops_gattc_if = gattc_if;
+  }
+
+  switch (event) {
+  case ESP_GATTC_CONNECT_EVT:
+    for (int idx = 0; idx < CONFIG_EXAMPLE_GATTC_OPS_MAX_LINKS; idx++) {
+      if (!links[idx].used) {
+        links[idx].used = true;
+        links[idx].issuing = false;
+        links[idx].conn_id = param->connect.conn_id;
+        memcpy(links[idx].remote_bda, param->connect.remote_bda, sizeof(esp_bd_addr_t));
+        links[idx].mtu = DEFAULT_MTU;
+        links[idx].in_flight = 0;
+        break;
+      }
+    }
+    break;
+  case ESP_GATTC_DISCONNECT_EVT: {
+    for (int idx = 0; idx < CONFIG_EXAMPLE_GATTC_OPS_MAX; idx++) {
+      if (ops[idx].conn_id != param->disconnect.conn_id) {
+        continue;
+      }
+      if (ops[idx].state == OP_TIMED_OUT) {
+        ops[idx].state = OP_FREE;
+      }
+      else if (ops[idx].state != OP_FREE) {
+        complete_op(&ops[idx], ESP_ERR_INVALID_STATE, ESP_GATT_ERROR, NULL, 0, &done);
+      }
+    }
+    gattc_link_t* link = find_link(param->disconnect.conn_id);
+    if (link != NULL) {
+      link->used = false;
+    }
+    break;
+  }
+  case ESP_GATTC_CFG_MTU_EVT: {
+    gattc_link_t* link = find_link(param->cfg_mtu.conn_id);
+    if (link != NULL && param->cfg_mtu.status == ESP_GATT_OK) {
+      link->mtu = param->cfg_mtu.mtu;
+    }
+    pump = handle_completion(GATTC_OP_MTU, param->cfg_mtu.conn_id, false, 0, param->cfg_mtu.status, NULL, 0,
+      &done, &pump_conn_id);
+    break;
+  }
+  case ESP_GATTC_SEARCH_RES_EVT: {
+    // Keep the first matching service, the search completes with SEARCH_CMPL
+    gattc_op_t* op = find_oldest_op(OP_IN_FLIGHT, param->search_res.conn_id, false, true, GATTC_OP_SEARCH_SERVICE, 0);
+    if (op != NULL && op->state == OP_IN_FLIGHT && op->handle == 0 && uuid_equal(&op->uuid, &param->search_res.srvc_id.uuid)) {
+      op->handle = param->search_res.start_handle;
+      op->end_handle = param->search_res.end_handle;
+    }
+    break;
+  }
+  case ESP_GATTC_SEARCH_CMPL_EVT:
+    pump = handle_completion(GATTC_OP_SEARCH_SERVICE, param->search_cmpl.conn_id, false, 0, param->search_cmpl.status,
+      NULL, 0, &done, &pump_conn_id);
+    break;
+  case ESP_GATTC_READ_CHAR_EVT:
+    pump = handle_completion(GATTC_OP_READ_CHAR, param->read.conn_id, false, param->read.handle, param->read.status,
+      param->read.value, param->read.value_len, &done, &pump_conn_id);
+    break;
+  case ESP_GATTC_READ_DESCR_EVT:
+    pump = handle_completion(GATTC_OP_READ_DESCR, param->read.conn_id, false, param->read.handle, param->read.status,
+      param->read.value, param->read.value_len, &done, &pump_conn_id);
+    break;
+  case ESP_GATTC_WRITE_CHAR_EVT:
+    pump = handle_completion(GATTC_OP_WRITE_CHAR, param->write.conn_id, false, param->write.handle, param->write.status,
+      NULL, 0, &done, &pump_conn_id);
+    break;
+  case ESP_GATTC_WRITE_DESCR_EVT:
+    pump = handle_completion(GATTC_OP_WRITE_DESCR, param->write.conn_id, false, param->write.handle, param->write.status,
+      NULL, 0, &done, &pump_conn_id);
+    break;
+  case ESP_GATTC_REG_FOR_NOTIFY_EVT:
+    // The event carries no conn_id
+    pump = handle_completion(GATTC_OP_REG_NOTIFY, 0, true, param->reg_for_notify.handle, param->reg_for_notify.status,
+      NULL, 0, &done, &pump_conn_id);
+    break;
+  default:
+    break;
+  }
+
+  xSemaphoreGive(ops_lock);
+
+  run_completions(&done);
+  if (pump) {
+    pump_link(pump_conn_id);
+  }
+}
+
+uint32_t gattc_op_mtu(uint16_t conn_id, gattc_op_cb_t cb, void* arg) {
+  return submit_op(GATTC_OP_MTU, conn_id, 0, NULL, NULL, 0, ESP_GATT_WRITE_TYPE_RSP, cb, arg);
+}
+
+uint32_t gattc_op_search_service(uint16_t conn_id, const esp_bt_uuid_t* uuid, gattc_op_cb_t cb, void* arg) {
+  return submit_op(GATTC_OP_SEARCH_SERVICE, conn_id, 0, uuid, NULL, 0, ESP_GATT_WRITE_TYPE_RSP, cb, arg);
+}
+
+uint32_t gattc_op_read_char(uint16_t conn_id, uint16_t handle, gattc_op_cb_t cb, void* arg) {
+  return submit_op(GATTC_OP_READ_CHAR, conn_id, handle, NULL, NULL, 0, ESP_GATT_WRITE_TYPE_RSP, cb, arg);
+}
+
+uint32_t gattc_op_write_char(uint16_t conn_id, uint16_t handle, const uint8_t* value, uint16_t len,
+  esp_gatt_write_type_t write_type, gattc_op_cb_t cb, void* arg) {
+  return submit_op(GATTC_OP_WRITE_CHAR, conn_id, handle, NULL, value, len, write_type, cb, arg);
+}
+
+uint32_t gattc_op_read_descr(uint16_t conn_id, uint16_t handle, gattc_op_cb_t cb, void* arg) {
+  return submit_op(GATTC_OP_READ_DESCR, conn_id, handle, NULL, NULL, 0, ESP_GATT_WRITE_TYPE_RSP, cb, arg);
+}
+
+uint32_t gattc_op_write_descr(uint16_t conn_id, uint16_t handle, const uint8_t* value, uint16_t len,
+  gattc_op_cb_t cb, void* arg) {
+  return submit_op(GATTC_OP_WRITE_DESCR, conn_id, handle, NULL, value, len, ESP_GATT_WRITE_TYPE_RSP, cb, arg);
+}
+
+uint32_t gattc_op_register_notify(uint16_t conn_id, uint16_t handle, gattc_op_cb_t cb, void* arg) {
+  return submit_op(GATTC_OP_REG_NOTIFY, conn_id, handle, NULL, NULL, 0, ESP_GATT_WRITE_TYPE_RSP, cb, arg);
+}
+
+uint16_t gattc_ops_get_mtu(uint16_t conn_id) {
+
+  xSemaphoreTake(ops_lock, portMAX_DELAY);
+  gattc_link_t* link = find_link(conn_id);
+  uint16_t mtu = link != NULL ? link->mtu : DEFAULT_MTU;
+  xSemaphoreGive(ops_lock);
+
+  return mtu;
+}
+
+uint8_t gattc_ops_get_in_flight(uint16_t conn_id) {
+
+  xSemaphoreTake(ops_lock, portMAX_DELAY);
+  gattc_link_t* link = find_link(conn_id);
+  uint8_t in_flight = link != NULL ? link->in_flight : 0;
+  xSemaphoreGive(ops_lock);
+
+  return in_flight;
+}
+
+bool gattc_ops_get_remote_bda(uint16_t conn_id, esp_bd_addr_t bda) {
+
+  xSemaphoreTake(ops_lock, portMAX_DELAY);
+  gattc_link_t* link = find_link(conn_id);
+  if (link != NULL) {
+    memcpy(bda, link->remote_bda, sizeof(esp_bd_addr_t));
+  }
+  xSemaphoreGive(ops_lock);
+
+  return link != NULL;
+}
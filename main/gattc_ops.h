@@ -0,0 +1,64 @@
+#pragma once
+
+#include "esp_gattc_api.h"
+#include "esp_gatt_defs.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define GATTC_OP_INVALID_ID 0
+
+  typedef enum {
+    GATTC_OP_MTU = 0,
+    GATTC_OP_SEARCH_SERVICE,
+    GATTC_OP_READ_CHAR,
+    GATTC_OP_WRITE_CHAR,
+    GATTC_OP_READ_DESCR,
+    GATTC_OP_WRITE_DESCR,
+    GATTC_OP_REG_NOTIFY,
+  } gattc_op_type_t;
+
+  typedef struct {
+    uint32_t id;
+    gattc_op_type_t type;
+    esp_err_t err;              // ESP_OK, ESP_ERR_TIMEOUT, ESP_ERR_INVALID_STATE on disconnect, ESP_FAIL on GATT error,
+                                // ESP_ERR_NOT_FOUND when a search found no matching service
+    esp_gatt_status_t status;
+    uint16_t conn_id;
+    uint16_t handle;            // service start handle for searches
+    uint16_t end_handle;        // searches only
+    const uint8_t* value;       // read ops only, valid during the callback
+    uint16_t value_len;
+  } gattc_op_result_t;
+
+  typedef void (*gattc_op_cb_t)(const gattc_op_result_t* result, void* arg);
+
+  esp_err_t gattc_ops_init();
+  /* Feed every GATTC event through here before the profile handlers */
+  void gattc_ops_handle_event(esp_gattc_cb_event_t event, esp_gatt_if_t gattc_if, esp_ble_gattc_cb_param_t* param);
+
+  /* Operations are queued per connection and handed to the stack as soon as the link's
+   * pipeline has room. Each returns a request ID, or GATTC_OP_INVALID_ID if it could not be queued.
+   * Write buffers must stay valid until the completion callback runs. A timed out operation
+   * keeps its slot until the late response of the stack or the disconnect. */
+  uint32_t gattc_op_mtu(uint16_t conn_id, gattc_op_cb_t cb, void* arg);
+  /* Completes with the handle range of the first service matching uuid, which must not be NULL */
+  uint32_t gattc_op_search_service(uint16_t conn_id, const esp_bt_uuid_t* uuid, gattc_op_cb_t cb, void* arg);
+  uint32_t gattc_op_read_char(uint16_t conn_id, uint16_t handle, gattc_op_cb_t cb, void* arg);
+  uint32_t gattc_op_write_char(uint16_t conn_id, uint16_t handle, const uint8_t* value, uint16_t len,
+    esp_gatt_write_type_t write_type, gattc_op_cb_t cb, void* arg);
+  uint32_t gattc_op_read_descr(uint16_t conn_id, uint16_t handle, gattc_op_cb_t cb, void* arg);
+  uint32_t gattc_op_write_descr(uint16_t conn_id, uint16_t handle, const uint8_t* value, uint16_t len,
+    gattc_op_cb_t cb, void* arg);
+  uint32_t gattc_op_register_notify(uint16_t conn_id, uint16_t handle, gattc_op_cb_t cb, void* arg);
+
+  /* Link state tracked from CONNECT / CFG_MTU / DISCONNECT events */
+  uint16_t gattc_ops_get_mtu(uint16_t conn_id);
+  uint8_t gattc_ops_get_in_flight(uint16_t conn_id);
+  bool gattc_ops_get_remote_bda(uint16_t conn_id, esp_bd_addr_t bda);
+
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,486 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "esp_gattc_api.h"
+#include "nvs.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/timers.h"
+#include "freertos/semphr.h"
+#include "known_devices.h"
+#include "mem_budget.h"
+
+#define TAG "KNOWN_DEV"
+
+#define NVS_NAMESPACE "known_dev"
+#define NVS_KEY       "devices"
+
+/* Persisted part of an entry */
+typedef struct {
+  esp_bd_addr_t bda;
+  uint8_t addr_type;
+} known_device_entry_t;
+
+typedef struct {
+  bool used;
+  bool connected;
+  bool open_pending;
+  known_device_entry_t entry;
+  TimerHandle_t reconnect_timer;
+  uint8_t attempt;
+  int64_t disconnect_us;    // 0 when no reconnect is being timed
+  uint32_t reconnects;
+  uint32_t last_reconnect_ms;
+  uint32_t max_reconnect_ms;
+  uint64_t total_reconnect_ms;
+} known_device_t;
+
+static known_device_t known_devices[CONFIG_EXAMPLE_KNOWN_DEVICES_MAX];
+static esp_gatt_if_t known_gattc_if = ESP_GATT_IF_NONE;
+/* The GATTC API can't withdraw a background open, the ones still pending for removed
+ * devices are remembered so their link is closed as soon as it opens */
+static esp_bd_addr_t cancelled_opens[CONFIG_EXAMPLE_KNOWN_DEVICES_MAX];
+static uint8_t cancelled_count = 0;
+static bool save_requested = false;
+/* Guards the table and the cancelled opens, the GAP/GATTC calls are made after releasing it */
+static SemaphoreHandle_t known_lock = NULL;
+#if CONFIG_EXAMPLE_STATIC_ALLOCATION
+static StaticTimer_t reconnect_timer_buffers[CONFIG_EXAMPLE_KNOWN_DEVICES_MAX];
+static StaticSemaphore_t known_lock_buffer;
+#endif
+
+/* The table helpers below and schedule_reconnect are called with known_lock held */
+
+static known_device_t* find_known_device(esp_bd_addr_t bda) {
+
+  for (int idx = 0; idx < CONFIG_EXAMPLE_KNOWN_DEVICES_MAX; idx++) {
+    if (known_devices[idx].used && memcmp(known_devices[idx].entry.bda, bda, sizeof(esp_bd_addr_t)) == 0) {
+      return &known_devices[idx];
+    }
+  }
+
+  return NULL;
+}
+
+// Returns true if a cancelled open of bda was pending, and forgets it
+static bool take_cancelled_open(esp_bd_addr_t bda) {
+
+  for (int idx = 0; idx < cancelled_count; idx++) {
+    if (memcmp(cancelled_opens[idx], bda, sizeof(esp_bd_addr_t)) == 0) {
+      cancelled_count--;
+      memcpy(cancelled_opens[idx], cancelled_opens[cancelled_count], sizeof(esp_bd_addr_t));
+      return true;
+    }
+  }
+
+  return false;
+}
+
+// Mark a background open as issued, so a removal in between records it as cancelled
+static bool claim_background_open(known_device_t* device, known_device_entry_t* entry) {
+
+  if (known_gattc_if == ESP_GATT_IF_NONE || !device->used || device->connected) {
+    return false;
+  }
+
+  device->open_pending = true;
+  *entry = device->entry;
+  return true;
+}
+
+static void save_known_devices(void* param1, uint32_t param2) {
+
+  known_device_entry_t entries[CONFIG_EXAMPLE_KNOWN_DEVICES_MAX];
+  size_t count = 0;
+  nvs_handle_t nvs;
+
+  xSemaphoreTake(known_lock, portMAX_DELAY);
+  save_requested = false;
+  for (int idx = 0; idx < CONFIG_EXAMPLE_KNOWN_DEVICES_MAX; idx++) {
+    if (known_devices[idx].used) {
+      entries[count++] = known_devices[idx].entry;
+    }
+  }
+  xSemaphoreGive(known_lock);
+
+  esp_err_t ret = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &nvs);
+  if (ret != ESP_OK) {
+    ESP_LOGE(TAG, "%s: nvs open failed: %s", __func__, esp_err_to_name(ret));
+    return;
+  }
+
+  if (count > 0) {
+    ret = nvs_set_blob(nvs, NVS_KEY, entries, count * sizeof(known_device_entry_t));
+  }
+  else {
+    ret = nvs_erase_key(nvs, NVS_KEY);
+    if (ret == ESP_ERR_NVS_NOT_FOUND) {
+      ret = ESP_OK;
+    }
+  }
+  if (ret == ESP_OK) {
+    ret = nvs_commit(nvs);
+  }
+  nvs_close(nvs);
+
+  if (ret != ESP_OK) {
+    ESP_LOGE(TAG, "%s: nvs write failed: %s", __func__, esp_err_to_name(ret));
+  }
+}
+
+// The flash write stalls the caller, it happens in the timer task instead of the BTC task
+static void request_save() {
+
+  if (!save_requested) {
+    save_requested = true;
+    if (xTimerPendFunctionCall(save_known_devices, NULL, 0, 0) != pdPASS) {
+      // The next change tries again
+      save_requested = false;
+      ESP_LOGE(TAG, "%s: Unable to defer the save", __func__);
+    }
+  }
+}
+
+static void update_whitelist(const known_device_entry_t* entry, bool add) {
+
+  esp_err_t ret = esp_ble_gap_update_whitelist(add, (uint8_t*)entry->bda,
+    entry->addr_type == BLE_ADDR_TYPE_PUBLIC ? BLE_WL_ADDR_TYPE_PUBLIC : BLE_WL_ADDR_TYPE_RANDOM);
+  if (ret) {
+    ESP_LOGE(TAG, "update whitelist error, error code = %x", ret);
+  }
+}
+
+// Non-direct open: the controller connects in the background as soon as the device advertises
+static void connect_background(const known_device_entry_t* entry) {
+
+  esp_err_t ret = esp_ble_gattc_open(known_gattc_if, (uint8_t*)entry->bda, entry->addr_type, false);
+  if (ret) {
+    ESP_LOGE(TAG, "background open error, error code = %x", ret);
+
+    xSemaphoreTake(known_lock, portMAX_DELAY);
+    known_device_t* device = find_known_device((uint8_t*)entry->bda);
+    if (device != NULL) {
+      device->open_pending = false;
+    }
+    else {
+      take_cancelled_open((uint8_t*)entry->bda);
+    }
+    xSemaphoreGive(known_lock);
+  }
+}
+
+static void vTimerCallbackReconnect(TimerHandle_t pxTimer) {
+
+  known_device_t* device = &known_devices[(intptr_t)pvTimerGetTimerID(pxTimer)];
+  known_device_entry_t entry;
+
+  xSemaphoreTake(known_lock, portMAX_DELAY);
+  bool open = claim_background_open(device, &entry);
+  xSemaphoreGive(known_lock);
+
+  if (open) {
+    connect_background(&entry);
+  }
+}
+
+// Exponential backoff with equal jitter: half of the delay is fixed, half is random
+static void schedule_reconnect(known_device_t* device) {
+
+  uint32_t delay_ms = CONFIG_EXAMPLE_KNOWN_DEVICES_BACKOFF_BASE_MS;
+  for (int idx = 0; idx < device->attempt && delay_ms < CONFIG_EXAMPLE_KNOWN_DEVICES_BACKOFF_MAX_MS; idx++) {
+    delay_ms *= 2;
+  }
+  if (delay_ms > CONFIG_EXAMPLE_KNOWN_DEVICES_BACKOFF_MAX_MS) {
+    delay_ms = CONFIG_EXAMPLE_KNOWN_DEVICES_BACKOFF_MAX_MS;
+  }
+  delay_ms = delay_ms / 2 + esp_random() % (delay_ms / 2 + 1);
+
+  if (device->attempt < UINT8_MAX) {
+    device->attempt++;
+  }
+
+  ESP_LOGI(TAG, "reconnect attempt %d in %d ms", device->attempt, delay_ms);
+
+  TickType_t ticks = pdMS_TO_TICKS(delay_ms);
+  if (xTimerChangePeriod(device->reconnect_timer, ticks > 0 ? ticks : 1, 0) != pdPASS) {
+    ESP_LOGE(TAG, "Unable to start reconnect timer.");
+  }
+}
+
+esp_err_t known_devices_init() {
+
+  known_device_entry_t entries[CONFIG_EXAMPLE_KNOWN_DEVICES_MAX];
+  size_t len = sizeof(entries);
+  nvs_handle_t nvs;
+
+#if CONFIG_EXAMPLE_STATIC_ALLOCATION
+  known_lock = xSemaphoreCreateMutexStatic(&known_lock_buffer);
+#else
+  known_lock = xSemaphoreCreateMutex();
+#endif
+  if (known_lock == NULL) {
+    ESP_LOGE(TAG, "%s: Unable to create lock", __func__);
+    return ESP_ERR_NO_MEM;
+  }
+
+  for (int idx = 0; idx < CONFIG_EXAMPLE_KNOWN_DEVICES_MAX; idx++) {
+#if CONFIG_EXAMPLE_STATIC_ALLOCATION
+    known_devices[idx].reconnect_timer = xTimerCreateStatic(
+      "Reconnect",
+      pdMS_TO_TICKS(CONFIG_EXAMPLE_KNOWN_DEVICES_BACKOFF_BASE_MS) + 1,
+      pdFALSE, // auto reload
+      (void*)(intptr_t)idx,
+      vTimerCallbackReconnect,
+      &reconnect_timer_buffers[idx]
+    );
+#else
+    known_devices[idx].reconnect_timer = xTimerCreate(
+      "Reconnect",
+      pdMS_TO_TICKS(CONFIG_EXAMPLE_KNOWN_DEVICES_BACKOFF_BASE_MS) + 1,
+      pdFALSE, // auto reload
+      (void*)(intptr_t)idx,
+      vTimerCallbackReconnect
+    );
+#endif
+    if (known_devices[idx].reconnect_timer == NULL) {
+      ESP_LOGE(TAG, "Unable to create timer.");
+      return ESP_ERR_NO_MEM;
+    }
+  }
+#if CONFIG_EXAMPLE_STATIC_ALLOCATION
+  mem_budget_add("known_devices", sizeof(known_devices) + sizeof(reconnect_timer_buffers) + sizeof(known_lock_buffer));
+#else
+  mem_budget_add("known_devices", sizeof(known_devices));
+#endif
+
+  // A device that can't load its known devices still scans, start with an empty set
+  esp_err_t ret = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &nvs);
+  if (ret != ESP_OK) {
+    ESP_LOGE(TAG, "%s: nvs open failed: %s", __func__, esp_err_to_name(ret));
+    return ESP_OK;
+  }
+
+  ret = nvs_get_blob(nvs, NVS_KEY, entries, &len);
+  if (ret == ESP_OK && len % sizeof(known_device_entry_t) != 0) {
+    ret = ESP_ERR_NVS_INVALID_LENGTH;
+  }
+  if (ret != ESP_OK && ret != ESP_ERR_NVS_NOT_FOUND) {
+    // Written by a build with a larger table, or damaged: drop it so the next boot is clean
+    ESP_LOGE(TAG, "%s: nvs read failed: %s, erasing the stored devices", __func__, esp_err_to_name(ret));
+    if (nvs_erase_key(nvs, NVS_KEY) == ESP_OK) {
+      nvs_commit(nvs);
+    }
+  }
+  nvs_close(nvs);
+  if (ret != ESP_OK) {
+    return ESP_OK;
+  }
+
+  for (int idx = 0; idx < len / sizeof(known_device_entry_t); idx++) {
+    known_devices[idx].used = true;
+    known_devices[idx].entry = entries[idx];
+  }
+  ESP_LOGI(TAG, "Loaded %d known devices", len / sizeof(known_device_entry_t));
+
+  return ESP_OK;
+}
+
+void known_devices_start(esp_gatt_if_t gattc_if) {
+
+  known_device_entry_t entries[CONFIG_EXAMPLE_KNOWN_DEVICES_MAX];
+  bool open[CONFIG_EXAMPLE_KNOWN_DEVICES_MAX];
+  int count = 0;
+
+  xSemaphoreTake(known_lock, portMAX_DELAY);
+  known_gattc_if = gattc_if;
+  for (int idx = 0; idx < CONFIG_EXAMPLE_KNOWN_DEVICES_MAX; idx++) {
+    if (known_devices[idx].used) {
+      entries[count] = known_devices[idx].entry;
+      open[count] = claim_background_open(&known_devices[idx], &entries[count]);
+      count++;
+    }
+  }
+  xSemaphoreGive(known_lock);
+
+  for (int idx = 0; idx < count; idx++) {
+    update_whitelist(&entries[idx], true);
+    if (open[idx]) {
+      connect_background(&entries[idx]);
+    }
+  }
+}
+
+esp_err_t known_devices_add(esp_bd_addr_t bda, esp_ble_addr_type_t addr_type) {
+
+  known_device_entry_t entry;
+
+  xSemaphoreTake(known_lock, portMAX_DELAY);
+  if (find_known_device(bda) != NULL) {
+    xSemaphoreGive(known_lock);
+    return ESP_OK;
+  }
+  // Known again, a background open still pending for it is welcome
+  take_cancelled_open(bda);
+
+  for (int idx = 0; idx < CONFIG_EXAMPLE_KNOWN_DEVICES_MAX; idx++) {
+    known_device_t* device = &known_devices[idx];
+
+    if (!device->used) {
+      device->used = true;
+      device->connected = false;
+      device->open_pending = false;
+      memcpy(device->entry.bda, bda, sizeof(esp_bd_addr_t));
+      device->entry.addr_type = addr_type;
+      device->attempt = 0;
+      device->disconnect_us = 0;
+      device->reconnects = 0;
+      device->last_reconnect_ms = 0;
+      device->max_reconnect_ms = 0;
+      device->total_reconnect_ms = 0;
+      entry = device->entry;
+      request_save();
+      xSemaphoreGive(known_lock);
+
+      update_whitelist(&entry, true);
+      return ESP_OK;
+    }
+  }
+  xSemaphoreGive(known_lock);
+
+  ESP_LOGE(TAG, "%s: Known device table full", __func__);
+  return ESP_ERR_NO_MEM;
+}
+
+esp_err_t known_devices_remove(esp_bd_addr_t bda) {
+
+  known_device_entry_t entry;
+
+  xSemaphoreTake(known_lock, portMAX_DELAY);
+  known_device_t* device = find_known_device(bda);
+  if (device == NULL) {
+    xSemaphoreGive(known_lock);
+    return ESP_ERR_NOT_FOUND;
+  }
+
+  xTimerStop(device->reconnect_timer, 0);
+  if (device->open_pending && cancelled_count < CONFIG_EXAMPLE_KNOWN_DEVICES_MAX) {
+    memcpy(cancelled_opens[cancelled_count++], device->entry.bda, sizeof(esp_bd_addr_t));
+  }
+  device->used = false;
+  entry = device->entry;
+  request_save();
+  xSemaphoreGive(known_lock);
+
+  update_whitelist(&entry, false);
+  return ESP_OK;
+}
+
+bool known_devices_contains(esp_bd_addr_t bda) {
+
+  xSemaphoreTake(known_lock, portMAX_DELAY);
+  bool found = find_known_device(bda) != NULL;
+  xSemaphoreGive(known_lock);
+
+  return found;
+}
+
+bool known_devices_get_addr_type(esp_bd_addr_t bda, esp_ble_addr_type_t* addr_type) {
+
+  xSemaphoreTake(known_lock, portMAX_DELAY);
+  known_device_t* device = find_known_device(bda);
+  if (device != NULL) {
+    *addr_type = device->entry.addr_type;
+  }
+  xSemaphoreGive(known_lock);
+
+  return device != NULL;
+}
+
+bool known_devices_on_open(esp_bd_addr_t bda, bool success) {
+
+  xSemaphoreTake(known_lock, portMAX_DELAY);
+  known_device_t* device = find_known_device(bda);
+  if (device == NULL) {
+    bool wanted = !take_cancelled_open(bda);
+    xSemaphoreGive(known_lock);
+    return wanted;
+  }
+
+  device->open_pending = false;
+
+  if (success) {
+    device->connected = true;
+    device->attempt = 0;
+  }
+  else {
+    schedule_reconnect(device);
+  }
+  xSemaphoreGive(known_lock);
+
+  return true;
+}
+
+void known_devices_on_disconnect(esp_bd_addr_t bda) {
+
+  xSemaphoreTake(known_lock, portMAX_DELAY);
+  known_device_t* device = find_known_device(bda);
+  if (device != NULL) {
+    device->connected = false;
+    device->attempt = 0;
+    device->disconnect_us = esp_timer_get_time();
+    schedule_reconnect(device);
+  }
+  xSemaphoreGive(known_lock);
+}
+
+void known_devices_on_link_ready(esp_bd_addr_t bda) {
+
+  xSemaphoreTake(known_lock, portMAX_DELAY);
+  known_device_t* device = find_known_device(bda);
+  if (device == NULL || device->disconnect_us == 0) {
+    xSemaphoreGive(known_lock);
+    return;
+  }
+
+  uint32_t elapsed_ms = (esp_timer_get_time() - device->disconnect_us) / 1000;
+
+  device->disconnect_us = 0;
+  device->reconnects++;
+  device->last_reconnect_ms = elapsed_ms;
+  device->total_reconnect_ms += elapsed_ms;
+  if (elapsed_ms > device->max_reconnect_ms) {
+    device->max_reconnect_ms = elapsed_ms;
+  }
+  xSemaphoreGive(known_lock);
+
+  ESP_LOGI(TAG, "Link ready %d ms after disconnect", elapsed_ms);
+}
+
+void display_known_devices() {
+
+  // Printed from a copy, the UART is too slow to hold the lock for
+  known_device_t devices[CONFIG_EXAMPLE_KNOWN_DEVICES_MAX];
+
+  xSemaphoreTake(known_lock, portMAX_DELAY);
+  memcpy(devices, known_devices, sizeof(devices));
+  xSemaphoreGive(known_lock);
+
+  printf("Known devices\n");
+  for (int idx = 0; idx < CONFIG_EXAMPLE_KNOWN_DEVICES_MAX; idx++) {
+    known_device_t* device = &devices[idx];
+
+    if (!device->used) {
+      continue;
+    }
+
+    printf("[%d] %02x:%02x:%02x:%02x:%02x:%02x %s, reconnects %u, last %u ms, avg %u ms, max %u ms\n", idx,
+      device->entry.bda[0], device->entry.bda[1], device->entry.bda[2],
+      device->entry.bda[3], device->entry.bda[4], device->entry.bda[5],
+      device->connected ? "connected" : "waiting",
+      device->reconnects, device->last_reconnect_ms,
+      device->reconnects ? (uint32_t)(device->total_reconnect_ms / device->reconnects) : 0,
+      device->max_reconnect_ms);
+  }
+}
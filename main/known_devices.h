@@ -0,0 +1,33 @@
+#pragma once
+
+#include "esp_gap_ble_api.h"
+#include "esp_gatt_defs.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+  /* Load the known devices from NVS, call once after nvs_flash_init */
+  esp_err_t known_devices_init();
+  /* Push the known devices into the controller whitelist and start background connections */
+  void known_devices_start(esp_gatt_if_t gattc_if);
+
+  /* Safe from any task, the NVS write is deferred to the timer task */
+  esp_err_t known_devices_add(esp_bd_addr_t bda, esp_ble_addr_type_t addr_type);
+  esp_err_t known_devices_remove(esp_bd_addr_t bda);
+  bool known_devices_contains(esp_bd_addr_t bda);
+  bool known_devices_get_addr_type(esp_bd_addr_t bda, esp_ble_addr_type_t* addr_type);
+
+  /* Connection life cycle, driven from the GATTC profile handler.
+   * known_devices_on_open returns false for a background open of a removed device,
+   * close the link unless it was opened on purpose. */
+  bool known_devices_on_open(esp_bd_addr_t bda, bool success);
+  void known_devices_on_disconnect(esp_bd_addr_t bda);
+  void known_devices_on_link_ready(esp_bd_addr_t bda);
+
+  void display_known_devices();
+
+
+#ifdef __cplusplus
+}
+#endif
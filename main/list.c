@@ -1,8 +1,14 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
 #include "list.h"
+#include "mem_budget.h"
+#include "scan_feed.h"
 
 // #include "esp_console.h"
 // #include "argtable3/argtable3.h"
@@ -16,7 +22,44 @@
 
 #define TAG "LIST"
 
+#define CACHE_SLOTS   (1 << CONFIG_EXAMPLE_SCAN_CACHE_BITS)
+#define CACHE_PROBES  8
+
+/* Last payload per address, so a repeated advert is matched without walking the list. Devices that
+ * were not worth listing (no name, no beacon) get a slot without a device, their repeats are skipped
+ * as well. Slots are never freed: when the probe window is full an unlisted device's slot is taken
+ * first, and a listed device that lost its slot is found again by walking the list. */
+typedef struct {
+  bool used;
+  bool payload_valid;
+  esp_bd_addr_t bda;
+  uint32_t payload_hash;
+  scan_results_list_t* device;    // NULL if not listed
+} scan_cache_slot_t;
+
 static scan_results_list_t* scan_list = NULL;
+static scan_results_list_t* scan_list_tail = NULL;
+static scan_cache_slot_t scan_cache[CACHE_SLOTS];
+// Reports come in on the BTC task, the lost sweep runs on the timer task and the menu reads the list
+static SemaphoreHandle_t list_lock = NULL;
+#if CONFIG_EXAMPLE_STATIC_ALLOCATION
+static StaticSemaphore_t list_lock_buffer;
+// Devices are never removed from the list, the pool is handed out in order
+static scan_results_list_t scan_list_pool[CONFIG_EXAMPLE_MAX_DEVICES];
+static int scan_list_pool_used = 0;
+static bool scan_list_full = false;
+#endif
+
+typedef struct {
+  uint32_t cache_hits;
+  uint32_t cache_misses;
+  uint64_t hit_cycles;
+  uint64_t miss_cycles;
+  uint32_t new_devices;
+  uint32_t cache_evictions;
+} scan_stats_t;
+
+static scan_stats_t scan_stats;
 
 static bool compare_bda(esp_bd_addr_t bda_src, esp_bd_addr_t bda_dest) {
 
@@ -32,98 +75,399 @@ static bool compare_bda(esp_bd_addr_t bda_src, esp_bd_addr_t bda_dest) {
 
 }
 
-void add_scan_rest_to_list(struct ble_scan_result_evt_param* scan_rst, uint8_t* dev_name, uint8_t dev_len) {
+// FNV-1a over adv data followed by scan response
+static uint32_t hash_payload(const struct ble_scan_result_evt_param* scan_rst) {
 
-  if (scan_rst == NULL) {
-    ESP_LOGE(TAG, "%s: Empty scan result \n", __func__);
-    return;
+  uint32_t hash = 2166136261u;
+  int len = scan_rst->adv_data_len + scan_rst->scan_rsp_len;
+
+  hash = (hash ^ scan_rst->adv_data_len) * 16777619u;
+  for (int idx = 0; idx < len; idx++) {
+    hash = (hash ^ scan_rst->ble_adv[idx]) * 16777619u;
   }
 
-  // search based on bda
-  if (scan_list == NULL) {
-    ESP_LOGI(TAG, "Adding first item %s: %x\n", dev_name, scan_rst->bda[0]);
+  return hash;
+}
 
-    esp_log_buffer_hex(TAG, scan_rst->bda, 6);
-    ESP_LOGI(TAG, "searched Adv Data Len %d, Scan Response Len %d", scan_rst->adv_data_len, scan_rst->scan_rsp_len);
-    ESP_LOGI(TAG, "searched Device Name Len %d", dev_len);
-    esp_log_buffer_char(TAG, dev_name, dev_len);
-    ESP_LOGI(TAG, "\n");
+static scan_results_list_t* alloc_list_item() {
 
-    scan_list = (scan_results_list_t*)malloc(sizeof(scan_results_list_t));
-    scan_list->data = *scan_rst;
-    strcpy(scan_list->dev_name, (char*)dev_name);
-    scan_list->pNext = NULL;
+#if CONFIG_EXAMPLE_STATIC_ALLOCATION
+  if (scan_list_pool_used >= CONFIG_EXAMPLE_MAX_DEVICES) {
+    // Warn once, the adverts of unlisted devices keep coming
+    if (!scan_list_full) {
+      ESP_LOGW(TAG, "%s: Scan list full, new devices are ignored", __func__);
+      scan_list_full = true;
+    }
+    return NULL;
   }
-  else {
+  return &scan_list_pool[scan_list_pool_used++];
+#else
+  scan_results_list_t* item = (scan_results_list_t*)malloc(sizeof(scan_results_list_t));
+  if (item == NULL) {
+    ESP_LOGE(TAG, "%s: No memory for a new device", __func__);
+  }
+  return item;
+#endif
+}
+
+// Names in adv data are not NUL terminated
+static void copy_dev_name(char* dst, const uint8_t* dev_name, uint8_t dev_len) {
+  memcpy(dst, dev_name, dev_len);
+  dst[dev_len] = '\0';
+}
+
+/* The functions below are called with list_lock held */
+
+static scan_results_list_t* find_device_by_bda(esp_bd_addr_t bda) {
 
-    // Search if the item exists or not yet
-    scan_results_list_t* pHead = scan_list;
-    scan_results_list_t* pPrev = scan_list;
-    while (pHead != NULL) {
-      // ESP_LOGI(TAG, "Traversing item in the list %x; Comparing with %x\n", scan_rst->bda[0], pHead->data.bda[0]);
-      if (compare_bda(pHead->data.bda, scan_rst->bda)) {
-        // Skip
-        break;
-      }
-      pPrev = pHead;
-      pHead = pHead->pNext;
+  scan_results_list_t* pHead = scan_list;
+
+  while (pHead != NULL) {
+    if (compare_bda(pHead->data.bda, bda)) {
+      break;
     }
+    pHead = pHead->pNext;
+  }
+
+  return pHead;
+}
+
+// FNV-1a over the address
+static uint32_t cache_index(const esp_bd_addr_t bda) {
 
-    if (pHead == NULL) {
-      // Add the new item to the list
-      scan_results_list_t* new_item;
+  uint32_t hash = 2166136261u;
 
-      new_item = (scan_results_list_t*)malloc(sizeof(scan_results_list_t));
-      new_item->data = *scan_rst;
-      strcpy(new_item->dev_name, (char*)dev_name);
-      new_item->pNext = NULL;
+  for (int idx = 0; idx < ESP_BD_ADDR_LEN; idx++) {
+    hash = (hash ^ bda[idx]) * 16777619u;
+  }
+
+  return hash & (CACHE_SLOTS - 1);
+}
+
+static scan_cache_slot_t* cache_find(esp_bd_addr_t bda) {
+
+  uint32_t home = cache_index(bda);
 
-      esp_log_buffer_hex(TAG, scan_rst->bda, 6);
-      ESP_LOGI(TAG, "searched Adv Data Len %d, Scan Response Len %d", scan_rst->adv_data_len, scan_rst->scan_rsp_len);
-      ESP_LOGI(TAG, "searched Device Name Len %d", dev_len);
-      esp_log_buffer_char(TAG, dev_name, dev_len);
-      ESP_LOGI(TAG, "\n");
+  for (int probe = 0; probe < CACHE_PROBES; probe++) {
+    scan_cache_slot_t* slot = &scan_cache[(home + probe) & (CACHE_SLOTS - 1)];
 
-      pPrev->pNext = new_item;
+    if (!slot->used) {
+      break;
+    }
+    if (compare_bda(slot->bda, bda)) {
+      return slot;
     }
   }
+
+  return NULL;
+}
+
+// Slot of bda, taking one if it has none. Only then is the list walked to find its device.
+static scan_cache_slot_t* cache_claim(esp_bd_addr_t bda) {
+
+  uint32_t home = cache_index(bda);
+  scan_cache_slot_t* victim = NULL;
+
+  for (int probe = 0; probe < CACHE_PROBES; probe++) {
+    scan_cache_slot_t* slot = &scan_cache[(home + probe) & (CACHE_SLOTS - 1)];
+
+    if (!slot->used) {
+      victim = slot;
+      break;
+    }
+    if (compare_bda(slot->bda, bda)) {
+      return slot;
+    }
+    if (victim == NULL && slot->device == NULL) {
+      victim = slot;
+    }
+  }
+
+  if (victim == NULL) {
+    victim = &scan_cache[home];
+  }
+  if (victim->used) {
+    scan_stats.cache_evictions++;
+  }
+
+  victim->used = true;
+  victim->payload_valid = false;
+  memcpy(victim->bda, bda, sizeof(esp_bd_addr_t));
+  victim->device = find_device_by_bda(bda);
+
+  return victim;
+}
+
+static void add_or_refresh(struct ble_scan_result_evt_param* scan_rst, uint8_t* dev_name, uint8_t dev_len, const beacon_record_t* beacon) {
+
+  scan_cache_slot_t* slot = cache_claim(scan_rst->bda);
+  scan_results_list_t* pHead = slot->device;
+
+  slot->payload_hash = hash_payload(scan_rst);
+  slot->payload_valid = true;
+
+  if (pHead != NULL) {
+    // Payload changed, refresh the entry
+    pHead->data = *scan_rst;
+    if (dev_len > 0) {
+      copy_dev_name(pHead->dev_name, dev_name, dev_len);
+    }
+    // Keep the latest frame, beacons like Eddystone rotate between frame types
+    if (beacon->type != BEACON_TYPE_NONE) {
+      pHead->beacon = *beacon;
+    }
+    pHead->last_seen_us = esp_timer_get_time();
+    pHead->reported_rssi = scan_rst->rssi;
+
+    scan_feed_publish(SCAN_FEED_PAYLOAD_CHANGED | (pHead->lost ? SCAN_FEED_DEVICE_ADDED : 0), pHead);
+    pHead->lost = false;
+    return;
+  }
+
+  // Add the new item to the list. Without room its repeats still take the fast path.
+  scan_results_list_t* new_item = alloc_list_item();
+  if (new_item == NULL) {
+    return;
+  }
+  new_item->data = *scan_rst;
+  copy_dev_name(new_item->dev_name, dev_name, dev_len);
+  new_item->beacon = *beacon;
+  new_item->last_seen_us = esp_timer_get_time();
+  new_item->reported_rssi = scan_rst->rssi;
+  new_item->lost = false;
+  new_item->pNext = NULL;
+
+  if (scan_list == NULL) {
+    ESP_LOGI(TAG, "Adding first item %.*s: %x\n", dev_len, dev_name, scan_rst->bda[0]);
+    scan_list = new_item;
+  }
+  else {
+    scan_list_tail->pNext = new_item;
+  }
+  scan_list_tail = new_item;
+  slot->device = new_item;
+
+  esp_log_buffer_hex(TAG, scan_rst->bda, 6);
+  ESP_LOGI(TAG, "searched Adv Data Len %d, Scan Response Len %d", scan_rst->adv_data_len, scan_rst->scan_rsp_len);
+  ESP_LOGI(TAG, "searched Device Name Len %d", dev_len);
+  esp_log_buffer_char(TAG, dev_name, dev_len);
+  ESP_LOGI(TAG, "\n");
+
+  scan_stats.new_devices++;
+
+  scan_feed_publish(SCAN_FEED_DEVICE_ADDED, new_item);
+}
+
+static bool refresh_if_unchanged(struct ble_scan_result_evt_param* scan_rst) {
+
+  scan_cache_slot_t* slot = cache_find(scan_rst->bda);
+
+  if (slot == NULL || !slot->payload_valid || slot->payload_hash != hash_payload(scan_rst)) {
+    return false;
+  }
+
+  scan_results_list_t* device = slot->device;
+  uint8_t events = 0;
+
+  if (device == NULL) {
+    // Still not worth listing
+    return true;
+  }
+
+  device->data.rssi = scan_rst->rssi;
+  device->last_seen_us = esp_timer_get_time();
+
+  if (device->lost) {
+    device->lost = false;
+    events |= SCAN_FEED_DEVICE_ADDED;
+  }
+  if (abs(scan_rst->rssi - device->reported_rssi) >= CONFIG_EXAMPLE_SCAN_FEED_RSSI_DELTA) {
+    device->reported_rssi = scan_rst->rssi;
+    events |= SCAN_FEED_RSSI_CHANGED;
+  }
+  if (events) {
+    scan_feed_publish(events, device);
+  }
+
+  return true;
+}
+
+esp_err_t scan_list_init() {
+
+#if CONFIG_EXAMPLE_STATIC_ALLOCATION
+  list_lock = xSemaphoreCreateMutexStatic(&list_lock_buffer);
+#else
+  list_lock = xSemaphoreCreateMutex();
+#endif
+  if (list_lock == NULL) {
+    ESP_LOGE(TAG, "%s: Unable to create lock", __func__);
+    return ESP_ERR_NO_MEM;
+  }
+#if CONFIG_EXAMPLE_STATIC_ALLOCATION
+  mem_budget_add("scan list", sizeof(scan_list_pool) + sizeof(scan_cache) + sizeof(list_lock_buffer));
+#else
+  mem_budget_add("scan list", sizeof(scan_cache));
+#endif
+
+  return ESP_OK;
+}
+
+void add_scan_rest_to_list(struct ble_scan_result_evt_param* scan_rst, uint8_t* dev_name, uint8_t dev_len, const beacon_record_t* beacon) {
+
+  if (scan_rst == NULL) {
+    ESP_LOGE(TAG, "%s: Empty scan result \n", __func__);
+    return;
+  }
+
+  xSemaphoreTake(list_lock, portMAX_DELAY);
+  add_or_refresh(scan_rst, dev_name, dev_len, beacon);
+  xSemaphoreGive(list_lock);
+}
+
+bool update_scan_rest_if_unchanged(struct ble_scan_result_evt_param* scan_rst) {
+
+  xSemaphoreTake(list_lock, portMAX_DELAY);
+  bool unchanged = refresh_if_unchanged(scan_rst);
+  xSemaphoreGive(list_lock);
+
+  return unchanged;
 }
 
 void display_scan_results() {
 
-  scan_results_list_t* pHead = scan_list;
+  // One entry is copied out at a time, the UART is too slow to hold the lock for the whole list
+  char dev_name[sizeof(scan_list->dev_name)];
+  beacon_record_t beacon;
+  scan_results_list_t* pHead;
   int idx = 0;
 
   printf("Displaying scan results\n");
+  xSemaphoreTake(list_lock, portMAX_DELAY);
+  pHead = scan_list;
+  xSemaphoreGive(list_lock);
+  // Entries are never freed, so pHead stays valid between the locked sections
   while (pHead != NULL) {
 
-    printf("[%d] %s\n", idx, pHead->dev_name);
+    xSemaphoreTake(list_lock, portMAX_DELAY);
+    strcpy(dev_name, pHead->dev_name);
+    beacon = pHead->beacon;
+    pHead = pHead->pNext;
+    xSemaphoreGive(list_lock);
+
+    printf("[%d] %s", idx, dev_name);
+    if (beacon.type != BEACON_TYPE_NONE) {
+      printf(" (");
+      beacon_print(&beacon);
+      printf(")");
+    }
+    printf("\n");
 
     idx++;
-    pHead = pHead->pNext;
   }
 }
 
-void find_device_by_index(uint8_t idx, struct ble_scan_result_evt_param** result) {
+bool find_device_by_index(uint8_t idx, struct ble_scan_result_evt_param* result) {
 
   int j = 0;
-  scan_results_list_t* pHead = scan_list;
-
-  *result = NULL;
+  scan_results_list_t* pHead;
+  bool found = false;
 
+  xSemaphoreTake(list_lock, portMAX_DELAY);
+  pHead = scan_list;
   while (pHead != NULL) {
-    ESP_LOGI(TAG, "Searching %d %d", j, idx);
     if (j == idx) {
-      *result = &(pHead->data);
-      ESP_LOGI(TAG, "Found %d %d", j, idx);
+      // Copied out, the BTC task keeps refreshing the entry
+      *result = pHead->data;
+      found = true;
       break;
     }
     pHead = pHead->pNext;
     j++;
   }
+  xSemaphoreGive(list_lock);
+
+  if (found) {
+    ESP_LOGI(TAG, "Found %d: %x", idx, result->bda[0]);
+  }
+
+  return found;
+}
+
+void ignore_scan_rest(struct ble_scan_result_evt_param* scan_rst) {
+
+  xSemaphoreTake(list_lock, portMAX_DELAY);
+  scan_cache_slot_t* slot = cache_claim(scan_rst->bda);
 
-  if (*result != NULL) {
-    ESP_LOGI(TAG, "Found %x", (*result)->bda[0]);
+  slot->payload_hash = hash_payload(scan_rst);
+  slot->payload_valid = true;
+  xSemaphoreGive(list_lock);
+}
+
+void invalidate_scan_rest_payload(esp_bd_addr_t bda) {
+
+  xSemaphoreTake(list_lock, portMAX_DELAY);
+  scan_cache_slot_t* slot = cache_find(bda);
+
+  if (slot != NULL) {
+    slot->payload_valid = false;
   }
+  xSemaphoreGive(list_lock);
+}
 
-}
\ No newline at end of file
+void update_scan_stats(bool cache_hit, uint32_t cycles) {
+
+  xSemaphoreTake(list_lock, portMAX_DELAY);
+  if (cache_hit) {
+    scan_stats.cache_hits++;
+    scan_stats.hit_cycles += cycles;
+  }
+  else {
+    scan_stats.cache_misses++;
+    scan_stats.miss_cycles += cycles;
+  }
+  xSemaphoreGive(list_lock);
+}
+
+void get_scan_counters(scan_counters_t* counters) {
+
+  xSemaphoreTake(list_lock, portMAX_DELAY);
+  counters->reports = scan_stats.cache_hits + scan_stats.cache_misses;
+  counters->unchanged = scan_stats.cache_hits;
+  counters->new_devices = scan_stats.new_devices;
+  counters->cycles = scan_stats.hit_cycles + scan_stats.miss_cycles;
+  xSemaphoreGive(list_lock);
+}
+
+void display_scan_stats() {
+
+  xSemaphoreTake(list_lock, portMAX_DELAY);
+  scan_stats_t stats = scan_stats;
+  xSemaphoreGive(list_lock);
+
+  uint32_t total = stats.cache_hits + stats.cache_misses;
+  uint32_t avg_hit = stats.cache_hits ? stats.hit_cycles / stats.cache_hits : 0;
+  uint32_t avg_miss = stats.cache_misses ? stats.miss_cycles / stats.cache_misses : 0;
+  uint64_t saved_cycles = avg_miss > avg_hit ? (uint64_t)(avg_miss - avg_hit) * stats.cache_hits : 0;
+
+  printf("Scan reports %u, payload unchanged %u (%u%%)\n", total, stats.cache_hits,
+    total ? stats.cache_hits * 100 / total : 0);
+  printf("Cycles per report: unchanged %u, parsed %u, saved %llu us\n", avg_hit, avg_miss,
+    saved_cycles / CONFIG_ESP32_DEFAULT_CPU_FREQ_MHZ);
+  printf("Payload cache evictions %u\n", stats.cache_evictions);
+}
+
+void sweep_lost_devices(int64_t seen_before_us, void (*lost_cb)(const struct scan_results_list* device)) {
+
+  scan_results_list_t* pHead;
+
+  xSemaphoreTake(list_lock, portMAX_DELAY);
+  pHead = scan_list;
+  while (pHead != NULL) {
+    if (!pHead->lost && pHead->last_seen_us < seen_before_us) {
+      pHead->lost = true;
+      lost_cb(pHead);
+    }
+    pHead = pHead->pNext;
+  }
+  xSemaphoreGive(list_lock);
+}
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "esp_gap_ble_api.h"
+#include "beacon.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -9,12 +10,40 @@ extern "C" {
   typedef struct scan_results_list {
     struct ble_scan_result_evt_param data;
     char dev_name[255];
+    beacon_record_t beacon;
+    int64_t last_seen_us;
+    int8_t reported_rssi;
+    bool lost;
     struct scan_results_list* pNext;
   } scan_results_list_t;
 
-  void add_scan_rest_to_list(struct ble_scan_result_evt_param* scan_rst, uint8_t* dev_name, uint8_t dev_len);
+  /* Call once before the first report, the list is shared between the BTC, timer and console tasks */
+  esp_err_t scan_list_init();
+  void add_scan_rest_to_list(struct ble_scan_result_evt_param* scan_rst, uint8_t* dev_name, uint8_t dev_len, const beacon_record_t* beacon);
   void display_scan_results();
-  void find_device_by_index(uint8_t idx, struct ble_scan_result_evt_param** result);
+  /* Copies the entry at idx into result, returns false if there is none */
+  bool find_device_by_index(uint8_t idx, struct ble_scan_result_evt_param* result);
+
+  /* Fast path for repeated adverts: if the adv + scan response payload of the device is unchanged,
+   * only refresh RSSI and timestamp of its entry, if it has one, and return true. */
+  bool update_scan_rest_if_unchanged(struct ble_scan_result_evt_param* scan_rst);
+  /* Remember the payload of a device that is not worth listing, so its repeats take the fast path */
+  void ignore_scan_rest(struct ble_scan_result_evt_param* scan_rst);
+  void invalidate_scan_rest_payload(esp_bd_addr_t bda);
+  void update_scan_stats(bool cache_hit, uint32_t cycles);
+
+  /* Running totals since boot, callers diff successive samples */
+  typedef struct {
+    uint32_t reports;
+    uint32_t unchanged;       // payload identical to the previous report of the device
+    uint32_t new_devices;
+    uint64_t cycles;          // spent handling reports
+  } scan_counters_t;
+
+  void get_scan_counters(scan_counters_t* counters);
+  void display_scan_stats();
+  /* Mark devices not seen since seen_before_us as lost and report each newly lost one */
+  void sweep_lost_devices(int64_t seen_before_us, void (*lost_cb)(const struct scan_results_list* device));
 
 
 #ifdef __cplusplus
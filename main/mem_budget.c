@@ -0,0 +1,38 @@
+#include <stdio.h>
+
+#include "esp_heap_caps.h"
+#include "mem_budget.h"
+
+#define MEM_BUDGET_MAX_ENTRIES 16
+
+typedef struct {
+  const char* name;
+  size_t bytes;
+} mem_budget_entry_t;
+
+static mem_budget_entry_t budget[MEM_BUDGET_MAX_ENTRIES];
+static int budget_count = 0;
+
+// Called from the init functions in app_main, before any other task runs them
+void mem_budget_add(const char* name, size_t bytes) {
+
+  if (budget_count < MEM_BUDGET_MAX_ENTRIES) {
+    budget[budget_count].name = name;
+    budget[budget_count].bytes = bytes;
+    budget_count++;
+  }
+}
+
+void display_memory_budget() {
+
+  size_t total = 0;
+
+  printf("Memory budget\n");
+  for (int idx = 0; idx < budget_count; idx++) {
+    printf("%-16s %7u bytes\n", budget[idx].name, budget[idx].bytes);
+    total += budget[idx].bytes;
+  }
+  printf("%-16s %7u bytes\n", "total static", total);
+  printf("Heap free %u bytes, minimum ever %u bytes\n", heap_caps_get_free_size(MALLOC_CAP_8BIT),
+    heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT));
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+  /* Register statically allocated storage of a module, name must be a string literal */
+  void mem_budget_add(const char* name, size_t bytes);
+  void display_memory_budget();
+
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,418 @@
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "sdkconfig.h"
+
+#if CONFIG_EXAMPLE_OCCUPANCY
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/timers.h"
+#include "occupancy.h"
+#include "mem_budget.h"
+
+#define TAG "OCCUPANCY"
+
+#define BUCKETS         CONFIG_EXAMPLE_OCCUPANCY_BUCKETS
+#define HLL_BITS        CONFIG_EXAMPLE_OCCUPANCY_HLL_BITS
+#define HLL_REGISTERS   (1 << HLL_BITS)
+#define BUCKET_US       ((int64_t)CONFIG_EXAMPLE_OCCUPANCY_WINDOW_S * 1000000 / BUCKETS)
+
+/* Count-min sketch of advert reports per manufacturer and per 16-bit service UUID. Counters are
+ * halved on every bucket rotation, so they follow the window roughly rather than exactly. */
+#define CMS_DEPTH       4
+#define CMS_WIDTH_BITS  CONFIG_EXAMPLE_OCCUPANCY_CMS_WIDTH_BITS
+#define CMS_WIDTH       (1 << CMS_WIDTH_BITS)
+#define TOP_K           5
+#define MAX_KEYS        8
+
+typedef enum {
+  KEY_MANUFACTURER = 0,
+  KEY_SERVICE_UUID,
+  KEY_KINDS,
+} key_kind_t;
+
+typedef struct {
+  uint16_t id;
+  uint32_t count;
+} top_entry_t;
+
+static uint8_t registers[BUCKETS][HLL_REGISTERS];
+static uint32_t cms[CMS_DEPTH][CMS_WIDTH];
+static top_entry_t top[KEY_KINDS][TOP_K];
+static int64_t current_epoch = -1;
+static uint32_t records = 0;
+static SemaphoreHandle_t occ_lock = NULL;
+#if CONFIG_EXAMPLE_STATIC_ALLOCATION
+static StaticSemaphore_t occ_lock_buffer;
+#endif
+#if CONFIG_EXAMPLE_OCCUPANCY_REPORT_S > 0
+static TimerHandle_t report_timer = NULL;
+#if CONFIG_EXAMPLE_STATIC_ALLOCATION
+static StaticTimer_t report_timer_buffer;
+#endif
+#endif
+
+// Odd multipliers, one independent row hash each
+static const uint32_t cms_seeds[CMS_DEPTH] = { 0x9E3779B1, 0x85EBCA77, 0xC2B2AE3D, 0x27D4EB2F };
+
+static const char* kind_names[KEY_KINDS] = { "manufacturers", "service UUIDs" };
+
+// MurmurHash3 finaliser, spreads the 48 address bits over the whole word
+static uint64_t hash_bda(const esp_bd_addr_t bda) {
+
+  uint64_t h = 0;
+
+  for (int i = 0; i < sizeof(esp_bd_addr_t); i++) {
+    h = (h << 8) | bda[i];
+  }
+  h ^= h >> 33;
+  h *= 0xFF51AFD7ED558CCDULL;
+  h ^= h >> 33;
+  h *= 0xC4CEB9FE1A85EC53ULL;
+  h ^= h >> 33;
+
+  return h;
+}
+
+// Multiply-shift hashing, the top bits of the product pick the column
+static uint32_t cms_index(int row, uint32_t key) {
+  return (key * cms_seeds[row]) >> (32 - CMS_WIDTH_BITS);
+}
+
+/* The functions below are called with occ_lock held */
+
+// Clear the buckets that fell out of the window since the last call
+static void rotate(int64_t now) {
+
+  int64_t epoch = now / BUCKET_US;
+
+  if (current_epoch < 0 || epoch - current_epoch >= BUCKETS) {
+    memset(registers, 0, sizeof(registers));
+    memset(cms, 0, sizeof(cms));
+    memset(top, 0, sizeof(top));
+    current_epoch = epoch;
+    return;
+  }
+
+  while (current_epoch < epoch) {
+    current_epoch++;
+    memset(registers[current_epoch % BUCKETS], 0, HLL_REGISTERS);
+    for (int row = 0; row < CMS_DEPTH; row++) {
+      for (int col = 0; col < CMS_WIDTH; col++) {
+        cms[row][col] >>= 1;
+      }
+    }
+    for (int kind = 0; kind < KEY_KINDS; kind++) {
+      for (int idx = 0; idx < TOP_K; idx++) {
+        top[kind][idx].count >>= 1;
+      }
+    }
+  }
+}
+
+static void count_key(key_kind_t kind, uint16_t id) {
+
+  uint32_t key = (kind << 16) | id;
+  uint32_t estimate = UINT32_MAX;
+
+  for (int row = 0; row < CMS_DEPTH; row++) {
+    uint32_t* counter = &cms[row][cms_index(row, key)];
+
+    if (*counter < UINT32_MAX) {
+      (*counter)++;
+    }
+    if (*counter < estimate) {
+      estimate = *counter;
+    }
+  }
+
+  // Keep the keys with the highest estimates, the sketch alone can't list them
+  top_entry_t* entries = top[kind];
+  top_entry_t* lowest = &entries[0];
+  for (int idx = 0; idx < TOP_K; idx++) {
+    if (entries[idx].count > 0 && entries[idx].id == id) {
+      entries[idx].count = estimate;
+      return;
+    }
+    if (entries[idx].count < lowest->count) {
+      lowest = &entries[idx];
+    }
+  }
+  if (estimate > lowest->count) {
+    lowest->id = id;
+    lowest->count = estimate;
+  }
+}
+
+// Bucket that holds the reports of age buckets ago, -1 if that is before the first report
+static int bucket_of_age(int age) {
+
+  if (current_epoch < age) {
+    return -1;
+  }
+
+  return (current_epoch - age) % BUCKETS;
+}
+
+// HyperLogLog estimate of the union of the buckets in mask
+static uint32_t estimate(uint32_t mask) {
+
+  float sum = 0;
+  int zeros = 0;
+
+  for (int reg = 0; reg < HLL_REGISTERS; reg++) {
+    uint8_t rank = 0;
+
+    for (int bucket = 0; bucket < BUCKETS; bucket++) {
+      if ((mask & (1u << bucket)) && registers[bucket][reg] > rank) {
+        rank = registers[bucket][reg];
+      }
+    }
+    sum += ldexpf(1.0f, -rank);
+    zeros += rank == 0;
+  }
+
+  float m = HLL_REGISTERS;
+  float raw = 0.7213f / (1.0f + 1.079f / m) * m * m / sum;
+
+  // Small range correction, linear counting is more accurate while registers are still empty
+  if (raw <= 2.5f * m && zeros > 0) {
+    raw = m * logf(m / zeros);
+  }
+
+  return (uint32_t)(raw + 0.5f);
+}
+
+// Sorted copy of a top list, highest first
+static int sorted_top(key_kind_t kind, top_entry_t* out) {
+
+  int count = 0;
+
+  for (int idx = 0; idx < TOP_K; idx++) {
+    if (top[kind][idx].count == 0) {
+      continue;
+    }
+    int pos = count++;
+    while (pos > 0 && out[pos - 1].count < top[kind][idx].count) {
+      out[pos] = out[pos - 1];
+      pos--;
+    }
+    out[pos] = top[kind][idx];
+  }
+
+  return count;
+}
+
+#if CONFIG_EXAMPLE_OCCUPANCY_REPORT_S > 0
+static void vTimerCallbackReport(TimerHandle_t pxTimer) {
+
+  uint32_t buckets[BUCKETS];
+  top_entry_t tops[KEY_KINDS][TOP_K];
+  int top_counts[KEY_KINDS];
+  uint32_t unique;
+
+  xSemaphoreTake(occ_lock, portMAX_DELAY);
+  rotate(esp_timer_get_time());
+  unique = estimate(UINT32_MAX);
+  for (int age = 0; age < BUCKETS; age++) {
+    int bucket = bucket_of_age(age);
+    buckets[age] = bucket < 0 ? 0 : estimate(1u << bucket);
+  }
+  for (int kind = 0; kind < KEY_KINDS; kind++) {
+    top_counts[kind] = sorted_top(kind, tops[kind]);
+  }
+  xSemaphoreGive(occ_lock);
+
+  // One line per report so a host can pick them out of the console output
+  printf("OCC,%" PRId64 ",%" PRIu32 ",", esp_timer_get_time() / 1000000, unique);
+  for (int age = 0; age < BUCKETS; age++) {
+    printf("%" PRIu32 "%c", buckets[age], age + 1 < BUCKETS ? ' ' : ',');
+  }
+  for (int kind = 0; kind < KEY_KINDS; kind++) {
+    for (int idx = 0; idx < top_counts[kind]; idx++) {
+      printf("%04x:%" PRIu32 "%c", tops[kind][idx].id, tops[kind][idx].count, idx + 1 < top_counts[kind] ? ' ' : ',');
+    }
+    if (top_counts[kind] == 0) {
+      printf(",");
+    }
+  }
+  printf("\n");
+}
+#endif
+
+esp_err_t occupancy_init() {
+
+#if CONFIG_EXAMPLE_STATIC_ALLOCATION
+  occ_lock = xSemaphoreCreateMutexStatic(&occ_lock_buffer);
+#else
+  occ_lock = xSemaphoreCreateMutex();
+#endif
+  if (occ_lock == NULL) {
+    ESP_LOGE(TAG, "%s: Unable to create lock", __func__);
+    return ESP_ERR_NO_MEM;
+  }
+
+#if CONFIG_EXAMPLE_STATIC_ALLOCATION
+  mem_budget_add("occupancy", sizeof(registers) + sizeof(cms) + sizeof(top) + sizeof(occ_lock_buffer)
+#if CONFIG_EXAMPLE_OCCUPANCY_REPORT_S > 0
+    + sizeof(report_timer_buffer)
+#endif
+  );
+#else
+  mem_budget_add("occupancy", sizeof(registers) + sizeof(cms) + sizeof(top));
+#endif
+
+#if CONFIG_EXAMPLE_OCCUPANCY_REPORT_S > 0
+#if CONFIG_EXAMPLE_STATIC_ALLOCATION
+  report_timer = xTimerCreateStatic(
+    "OccReport",
+    pdMS_TO_TICKS(CONFIG_EXAMPLE_OCCUPANCY_REPORT_S * 1000),
+    pdTRUE, // auto reload
+    (void*)0,
+    vTimerCallbackReport,
+    &report_timer_buffer
+  );
+#else
+  report_timer = xTimerCreate(
+    "OccReport",
+    pdMS_TO_TICKS(CONFIG_EXAMPLE_OCCUPANCY_REPORT_S * 1000),
+    pdTRUE, // auto reload
+    (void*)0,
+    vTimerCallbackReport
+  );
+#endif
+  if (report_timer == NULL || xTimerStart(report_timer, 0) != pdPASS) {
+    ESP_LOGE(TAG, "%s: Unable to start report timer", __func__);
+    return ESP_FAIL;
+  }
+#endif
+
+  return ESP_OK;
+}
+
+void occupancy_record(const struct ble_scan_result_evt_param* scan_rst) {
+
+  const uint8_t* payload = scan_rst->ble_adv;
+  uint16_t len = scan_rst->adv_data_len + scan_rst->scan_rsp_len;
+  uint16_t pos = 0;
+  uint8_t kinds[MAX_KEYS];
+  uint16_t ids[MAX_KEYS];
+  int key_count = 0;
+
+  if (occ_lock == NULL) {
+    return;
+  }
+
+  // Manufacturer and 16-bit service UUIDs, parsed before taking the lock
+  while (pos + 1 < len && key_count < MAX_KEYS) {
+    uint8_t field_len = payload[pos];
+    uint8_t type = payload[pos + 1];
+
+    if (field_len == 0 || pos + 1 + field_len > len) {
+      break;
+    }
+    if (type == ESP_BLE_AD_MANUFACTURER_SPECIFIC_TYPE && field_len >= 3) {
+      kinds[key_count] = KEY_MANUFACTURER;
+      ids[key_count++] = payload[pos + 2] | (payload[pos + 3] << 8);
+    }
+    else if (type == ESP_BLE_AD_TYPE_16SRV_CMPL || type == ESP_BLE_AD_TYPE_16SRV_PART) {
+      for (int off = 2; off + 1 <= field_len && key_count < MAX_KEYS; off += 2) {
+        kinds[key_count] = KEY_SERVICE_UUID;
+        ids[key_count++] = payload[pos + off] | (payload[pos + off + 1] << 8);
+      }
+    }
+    pos += 1 + field_len;
+  }
+
+  uint64_t hash = hash_bda(scan_rst->bda);
+  uint16_t reg = hash >> (64 - HLL_BITS);
+  uint64_t rest = hash << HLL_BITS;
+  // Position of the first set bit after the register index
+  uint8_t rank = rest ? __builtin_clzll(rest) + 1 : 64 - HLL_BITS + 1;
+
+  xSemaphoreTake(occ_lock, portMAX_DELAY);
+  rotate(esp_timer_get_time());
+  uint8_t* bucket = registers[current_epoch % BUCKETS];
+  if (rank > bucket[reg]) {
+    bucket[reg] = rank;
+  }
+  for (int idx = 0; idx < key_count; idx++) {
+    count_key(kinds[idx], ids[idx]);
+  }
+  records++;
+  xSemaphoreGive(occ_lock);
+}
+
+uint32_t occupancy_unique() {
+
+  uint32_t unique;
+
+  xSemaphoreTake(occ_lock, portMAX_DELAY);
+  rotate(esp_timer_get_time());
+  unique = estimate(UINT32_MAX);
+  xSemaphoreGive(occ_lock);
+
+  return unique;
+}
+
+uint32_t occupancy_bucket_unique(int age) {
+
+  uint32_t unique;
+
+  if (age < 0 || age >= BUCKETS) {
+    return 0;
+  }
+
+  xSemaphoreTake(occ_lock, portMAX_DELAY);
+  rotate(esp_timer_get_time());
+  int bucket = bucket_of_age(age);
+  unique = bucket < 0 ? 0 : estimate(1u << bucket);
+  xSemaphoreGive(occ_lock);
+
+  return unique;
+}
+
+void display_occupancy() {
+
+  top_entry_t tops[TOP_K];
+
+  if (occ_lock == NULL) {
+    return;
+  }
+
+  xSemaphoreTake(occ_lock, portMAX_DELAY);
+  uint32_t reports = records;
+  xSemaphoreGive(occ_lock);
+
+  printf("Unique devices in the last %d s: ~%" PRIu32 " (%" PRIu32 " reports)\n", CONFIG_EXAMPLE_OCCUPANCY_WINDOW_S,
+    occupancy_unique(), reports);
+  // Buckets can be shorter than a second
+  printf("Per %" PRId64 " ms bucket, newest first:", BUCKET_US / 1000);
+  for (int age = 0; age < BUCKETS; age++) {
+    printf(" %" PRIu32, occupancy_bucket_unique(age));
+  }
+  printf("\n");
+
+  for (int kind = 0; kind < KEY_KINDS; kind++) {
+    xSemaphoreTake(occ_lock, portMAX_DELAY);
+    int count = sorted_top(kind, tops);
+    xSemaphoreGive(occ_lock);
+
+    printf("Top %s by reports:", kind_names[kind]);
+    for (int idx = 0; idx < count; idx++) {
+      printf(" %04x (~%" PRIu32 ")", tops[idx].id, tops[idx].count);
+    }
+    printf("\n");
+  }
+  // Standard error 1.04 / sqrt(m), in tenths of a percent
+  int error = (int)(1040 / sqrtf(HLL_REGISTERS) + 0.5f);
+  printf("Sketch memory %zu bytes, unique count error about %d.%d%%\n",
+    sizeof(registers) + sizeof(cms) + sizeof(top), error / 10, error % 10);
+}
+
+#endif
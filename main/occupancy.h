@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "esp_err.h"
+#include "esp_gap_ble_api.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+  /* Memory is fixed at init whatever the number of devices, estimates are approximate.
+   * Unique counts come from HyperLogLog sketches, one per time bucket of the window. */
+  esp_err_t occupancy_init();
+  void occupancy_record(const struct ble_scan_result_evt_param* scan_rst);
+  /* Unique addresses seen over the whole window */
+  uint32_t occupancy_unique();
+  /* Unique addresses seen in one bucket, age 0 is the current one */
+  uint32_t occupancy_bucket_unique(int age);
+  void display_occupancy();
+
+
+#ifdef __cplusplus
+}
+#endif
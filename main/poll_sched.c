@@ -0,0 +1,451 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/timers.h"
+#include "gattc_ops.h"
+#include "poll_sched.h"
+#include "mem_budget.h"
+
+#define TAG "POLL_SCHED"
+
+/* Two level timing wheel: level 0 has one slot per tick, level 1 one slot per level 0 revolution.
+ * Targets further out than level 1 covers are parked in its last slot and re-cascaded. */
+#define WHEEL_BITS      6
+#define WHEEL_SLOTS     (1 << WHEEL_BITS)
+#define WHEEL_MASK      (WHEEL_SLOTS - 1)
+#define WHEEL_SPAN      (WHEEL_SLOTS * WHEEL_SLOTS)
+
+/* Targets that were due but held back by the rate limits wait here in FIFO order */
+#define DEFERRED_SLOT   (2 * WHEEL_SLOTS)
+
+#define NIL             0xFFFF
+
+typedef struct {
+  bool used;
+  bool in_flight;
+  uint16_t generation;
+  uint16_t conn_id;
+  uint16_t handle;
+  uint16_t next;
+  uint16_t prev;
+  uint8_t slot;             // index into wheel[], level 1 slots follow level 0, then the deferred list
+  uint32_t period_ticks;
+  uint32_t expires;         // tick the target sits in the wheel for
+  uint32_t due;             // nominal deadline, differs from expires while deferred
+  poll_sched_cb_t cb;
+  void* arg;
+} poll_target_t;
+
+typedef struct {
+  bool used;
+  uint16_t conn_id;
+  uint8_t in_flight;
+} poll_link_t;
+
+static poll_target_t targets[CONFIG_EXAMPLE_POLL_MAX_TARGETS];
+static uint16_t wheel[2 * WHEEL_SLOTS + 1];
+static uint16_t deferred_tail = NIL;
+static poll_link_t links[CONFIG_EXAMPLE_GATTC_OPS_MAX_LINKS];
+static uint32_t current_tick = 0;
+static SemaphoreHandle_t poll_lock = NULL;
+static TimerHandle_t tick_timer = NULL;
+#if CONFIG_EXAMPLE_STATIC_ALLOCATION
+static StaticSemaphore_t poll_lock_buffer;
+static StaticTimer_t tick_timer_buffer;
+#endif
+
+static struct {
+  uint32_t reads;
+  uint32_t completed;
+  uint32_t failed;
+  uint32_t missed;
+  uint32_t deferred;
+  uint64_t jitter_ticks;
+  uint32_t max_jitter_ticks;
+} poll_stats;
+
+static void wheel_unlink(uint16_t idx) {
+
+  poll_target_t* target = &targets[idx];
+
+  if (target->prev != NIL) {
+    targets[target->prev].next = target->next;
+  }
+  else {
+    wheel[target->slot] = target->next;
+  }
+  if (target->next != NIL) {
+    targets[target->next].prev = target->prev;
+  }
+  else if (target->slot == DEFERRED_SLOT) {
+    deferred_tail = target->prev;
+  }
+}
+
+static void defer_target(uint16_t idx) {
+
+  poll_target_t* target = &targets[idx];
+
+  target->slot = DEFERRED_SLOT;
+  target->next = NIL;
+  target->prev = deferred_tail;
+  if (deferred_tail != NIL) {
+    targets[deferred_tail].next = idx;
+  }
+  else {
+    wheel[DEFERRED_SLOT] = idx;
+  }
+  deferred_tail = idx;
+}
+
+static void wheel_insert(uint16_t idx, uint32_t expires) {
+
+  poll_target_t* target = &targets[idx];
+  int32_t delta = (int32_t)(expires - current_tick);
+
+  // delta 0 only happens while cascading, the current level 0 slot is processed right after
+  if (delta < 0) {
+    expires = current_tick + 1;
+    delta = 1;
+  }
+
+  if (delta < WHEEL_SLOTS) {
+    target->slot = expires & WHEEL_MASK;
+  }
+  else if (delta < WHEEL_SPAN) {
+    target->slot = WHEEL_SLOTS + ((expires >> WHEEL_BITS) & WHEEL_MASK);
+  }
+  else {
+    target->slot = WHEEL_SLOTS + (((current_tick >> WHEEL_BITS) + WHEEL_MASK) & WHEEL_MASK);
+  }
+
+  target->expires = expires;
+  target->prev = NIL;
+  target->next = wheel[target->slot];
+  if (target->next != NIL) {
+    targets[target->next].prev = idx;
+  }
+  wheel[target->slot] = idx;
+}
+
+static poll_link_t* find_link(uint16_t conn_id, bool create) {
+
+  poll_link_t* free_link = NULL;
+
+  for (int idx = 0; idx < CONFIG_EXAMPLE_GATTC_OPS_MAX_LINKS; idx++) {
+    if (links[idx].used && links[idx].conn_id == conn_id) {
+      return &links[idx];
+    }
+    if (!links[idx].used && free_link == NULL) {
+      free_link = &links[idx];
+    }
+  }
+
+  if (create && free_link != NULL) {
+    free_link->used = true;
+    free_link->conn_id = conn_id;
+    free_link->in_flight = 0;
+    return free_link;
+  }
+
+  return NULL;
+}
+
+// Called with poll_lock held once a read of the target has finished, successfully or not
+static void finish_read(poll_target_t* target) {
+
+  poll_link_t* link = find_link(target->conn_id, false);
+
+  target->in_flight = false;
+  if (link != NULL && link->in_flight > 0) {
+    link->in_flight--;
+  }
+}
+
+static void on_read_done(const gattc_op_result_t* result, void* arg) {
+
+  uint16_t idx = (uintptr_t)arg & 0xFFFF;
+  uint16_t generation = (uintptr_t)arg >> 16;
+  poll_sched_cb_t cb = NULL;
+  void* cb_arg = NULL;
+
+  xSemaphoreTake(poll_lock, portMAX_DELAY);
+  poll_target_t* target = &targets[idx];
+  if (target->used && target->generation == generation) {
+    finish_read(target);
+    cb = target->cb;
+    cb_arg = target->arg;
+  }
+  if (result->err == ESP_OK) {
+    poll_stats.completed++;
+  }
+  else {
+    poll_stats.failed++;
+  }
+  xSemaphoreGive(poll_lock);
+
+  if (cb != NULL) {
+    if (result->err == ESP_OK) {
+      cb(result->conn_id, result->handle, result->value, result->value_len, cb_arg);
+    }
+    else {
+      cb(result->conn_id, result->handle, NULL, 0, cb_arg);
+    }
+  }
+}
+
+/* Called with poll_lock held for a target whose slot came up. Returns true if a read should be issued. */
+static bool fire_target(uint16_t idx, int issue_count) {
+
+  poll_target_t* target = &targets[idx];
+  bool issue = false;
+
+  // Previous read still outstanding, drop this period
+  if (target->in_flight) {
+    poll_stats.missed++;
+  }
+  else {
+    poll_link_t* link = find_link(target->conn_id, true);
+
+    // Spread bursts over the following ticks
+    if (issue_count >= CONFIG_EXAMPLE_POLL_MAX_READS_PER_TICK || link == NULL ||
+      link->in_flight >= CONFIG_EXAMPLE_POLL_MAX_IN_FLIGHT_PER_LINK) {
+      poll_stats.deferred++;
+      defer_target(idx);
+      return false;
+    }
+
+    uint32_t jitter = current_tick - target->due;
+    poll_stats.jitter_ticks += jitter;
+    if (jitter > poll_stats.max_jitter_ticks) {
+      poll_stats.max_jitter_ticks = jitter;
+    }
+
+    target->in_flight = true;
+    link->in_flight++;
+    issue = true;
+  }
+
+  // Next deadline stays on the period grid, skipped periods count as missed
+  target->due += target->period_ticks;
+  while ((int32_t)(target->due - current_tick) <= 0) {
+    target->due += target->period_ticks;
+    poll_stats.missed++;
+  }
+  wheel_insert(idx, target->due);
+
+  return issue;
+}
+
+static void vTimerCallbackTick(TimerHandle_t pxTimer) {
+
+  uint16_t issue[CONFIG_EXAMPLE_POLL_MAX_READS_PER_TICK];
+  uint32_t generations[CONFIG_EXAMPLE_POLL_MAX_READS_PER_TICK];
+  int issue_count = 0;
+
+  xSemaphoreTake(poll_lock, portMAX_DELAY);
+
+  current_tick++;
+
+  // Level 0 wrapped, move the next level 1 slot down
+  if ((current_tick & WHEEL_MASK) == 0) {
+    uint8_t slot = WHEEL_SLOTS + ((current_tick >> WHEEL_BITS) & WHEEL_MASK);
+    uint16_t idx = wheel[slot];
+
+    wheel[slot] = NIL;
+    while (idx != NIL) {
+      uint16_t next = targets[idx].next;
+      wheel_insert(idx, targets[idx].expires);
+      idx = next;
+    }
+  }
+
+  // Targets held back on earlier ticks go first, then the ones due now
+  uint8_t slots[2] = { DEFERRED_SLOT, current_tick & WHEEL_MASK };
+  for (int i = 0; i < 2; i++) {
+    uint16_t idx = wheel[slots[i]];
+
+    wheel[slots[i]] = NIL;
+    if (slots[i] == DEFERRED_SLOT) {
+      deferred_tail = NIL;
+    }
+    while (idx != NIL) {
+      uint16_t next = targets[idx].next;
+
+      if (fire_target(idx, issue_count)) {
+        issue[issue_count] = idx;
+        generations[issue_count] = targets[idx].generation;
+        issue_count++;
+      }
+      idx = next;
+    }
+  }
+
+  xSemaphoreGive(poll_lock);
+
+  // Issue outside the lock, a failed submit completes synchronously
+  for (int i = 0; i < issue_count; i++) {
+    poll_target_t* target = &targets[issue[i]];
+    void* arg = (void*)(uintptr_t)(issue[i] | (generations[i] << 16));
+
+    if (gattc_op_read_char(target->conn_id, target->handle, on_read_done, arg) == GATTC_OP_INVALID_ID) {
+      xSemaphoreTake(poll_lock, portMAX_DELAY);
+      if (target->used && target->generation == generations[i]) {
+        finish_read(target);
+      }
+      poll_stats.failed++;
+      xSemaphoreGive(poll_lock);
+    }
+    else {
+      poll_stats.reads++;
+    }
+  }
+}
+
+esp_err_t poll_sched_init() {
+
+  for (int idx = 0; idx < 2 * WHEEL_SLOTS + 1; idx++) {
+    wheel[idx] = NIL;
+  }
+
+#if CONFIG_EXAMPLE_STATIC_ALLOCATION
+  poll_lock = xSemaphoreCreateMutexStatic(&poll_lock_buffer);
+#else
+  poll_lock = xSemaphoreCreateMutex();
+#endif
+  if (poll_lock == NULL) {
+    ESP_LOGE(TAG, "%s: Unable to create lock", __func__);
+    return ESP_ERR_NO_MEM;
+  }
+
+#if CONFIG_EXAMPLE_STATIC_ALLOCATION
+  tick_timer = xTimerCreateStatic(
+    "PollTick",
+    pdMS_TO_TICKS(CONFIG_EXAMPLE_POLL_TICK_MS),
+    pdTRUE, // auto reload
+    (void*)0,
+    vTimerCallbackTick,
+    &tick_timer_buffer
+  );
+  mem_budget_add("poll_sched", sizeof(targets) + sizeof(wheel) + sizeof(links) +
+    sizeof(poll_lock_buffer) + sizeof(tick_timer_buffer));
+#else
+  tick_timer = xTimerCreate(
+    "PollTick",
+    pdMS_TO_TICKS(CONFIG_EXAMPLE_POLL_TICK_MS),
+    pdTRUE, // auto reload
+    (void*)0,
+    vTimerCallbackTick
+  );
+  mem_budget_add("poll_sched", sizeof(targets) + sizeof(wheel) + sizeof(links));
+#endif
+  if (tick_timer == NULL || xTimerStart(tick_timer, 0) != pdPASS) {
+    ESP_LOGE(TAG, "%s: Unable to start tick timer", __func__);
+    return ESP_FAIL;
+  }
+
+  return ESP_OK;
+}
+
+int poll_sched_add(uint16_t conn_id, uint16_t handle, uint32_t period_ms, poll_sched_cb_t cb, void* arg) {
+
+  int result = POLL_SCHED_INVALID_TARGET;
+  uint32_t period_ticks = (period_ms + CONFIG_EXAMPLE_POLL_TICK_MS - 1) / CONFIG_EXAMPLE_POLL_TICK_MS;
+
+  if (poll_lock == NULL || period_ticks == 0) {
+    return POLL_SCHED_INVALID_TARGET;
+  }
+
+  xSemaphoreTake(poll_lock, portMAX_DELAY);
+  for (int idx = 0; idx < CONFIG_EXAMPLE_POLL_MAX_TARGETS; idx++) {
+    poll_target_t* target = &targets[idx];
+
+    if (!target->used) {
+      target->used = true;
+      target->in_flight = false;
+      target->generation++;
+      target->conn_id = conn_id;
+      target->handle = handle;
+      target->period_ticks = period_ticks;
+      target->cb = cb;
+      target->arg = arg;
+      // Spread the first deadline over the period so targets with equal periods don't fire together
+      target->due = current_tick + 1 + (idx * 2654435761u >> 16) % period_ticks;
+      wheel_insert(idx, target->due);
+      result = idx;
+      break;
+    }
+  }
+  xSemaphoreGive(poll_lock);
+
+  if (result == POLL_SCHED_INVALID_TARGET) {
+    ESP_LOGE(TAG, "%s: Target table full", __func__);
+  }
+
+  return result;
+}
+
+static void remove_target(uint16_t idx) {
+
+  poll_target_t* target = &targets[idx];
+
+  if (!target->used) {
+    return;
+  }
+
+  wheel_unlink(idx);
+  if (target->in_flight) {
+    finish_read(target);
+  }
+  target->used = false;
+}
+
+void poll_sched_remove(int target) {
+
+  if (target < 0 || target >= CONFIG_EXAMPLE_POLL_MAX_TARGETS) {
+    return;
+  }
+
+  xSemaphoreTake(poll_lock, portMAX_DELAY);
+  remove_target(target);
+  xSemaphoreGive(poll_lock);
+}
+
+void poll_sched_remove_conn(uint16_t conn_id) {
+
+  if (poll_lock == NULL) {
+    return;
+  }
+
+  xSemaphoreTake(poll_lock, portMAX_DELAY);
+  for (int idx = 0; idx < CONFIG_EXAMPLE_POLL_MAX_TARGETS; idx++) {
+    if (targets[idx].used && targets[idx].conn_id == conn_id) {
+      remove_target(idx);
+    }
+  }
+  poll_link_t* link = find_link(conn_id, false);
+  if (link != NULL) {
+    link->used = false;
+  }
+  xSemaphoreGive(poll_lock);
+}
+
+void display_poll_stats() {
+
+  int active = 0;
+
+  for (int idx = 0; idx < CONFIG_EXAMPLE_POLL_MAX_TARGETS; idx++) {
+    if (targets[idx].used) {
+      active++;
+    }
+  }
+
+  printf("Poll targets %d, reads %u, completed %u, failed %u, missed deadlines %u, deferred %u\n",
+    active, poll_stats.reads, poll_stats.completed, poll_stats.failed, poll_stats.missed, poll_stats.deferred);
+  printf("Poll jitter avg %u ms, max %u ms\n",
+    poll_stats.reads ? (uint32_t)(poll_stats.jitter_ticks * CONFIG_EXAMPLE_POLL_TICK_MS / poll_stats.reads) : 0,
+    poll_stats.max_jitter_ticks * CONFIG_EXAMPLE_POLL_TICK_MS);
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define POLL_SCHED_INVALID_TARGET (-1)
+
+  /* value is NULL with len 0 when the read failed */
+  typedef void (*poll_sched_cb_t)(uint16_t conn_id, uint16_t handle, const uint8_t* value, uint16_t len, void* arg);
+
+  esp_err_t poll_sched_init();
+  /* Read the characteristic every period_ms. Returns a target ID or POLL_SCHED_INVALID_TARGET. */
+  int poll_sched_add(uint16_t conn_id, uint16_t handle, uint32_t period_ms, poll_sched_cb_t cb, void* arg);
+  void poll_sched_remove(int target);
+  void poll_sched_remove_conn(uint16_t conn_id);
+  void display_poll_stats();
+
+
+#ifdef __cplusplus
+}
+#endif
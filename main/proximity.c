@@ -0,0 +1,342 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "hal/cpu_hal.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/timers.h"
+#include "proximity.h"
+#include "mem_budget.h"
+
+#define TAG "PROXIMITY"
+
+#define MAX_DEVICES CONFIG_EXAMPLE_PROX_MAX_DEVICES
+
+#define KEY_USED             (1ULL << 48)
+#define KALMAN_GAIN_BITS     14
+// Noise settings are in 0.01 dB^2, the filter state is Q8
+#define NOISE_Q8(hundredths) ((hundredths) * 256 / 100)
+#define PROCESS_NOISE_Q8     NOISE_Q8(CONFIG_EXAMPLE_PROX_PROCESS_NOISE)
+#define MEASUREMENT_NOISE_Q8 NOISE_Q8(CONFIG_EXAMPLE_PROX_MEASUREMENT_NOISE)
+// Advertised TX power levels are at 0 m, free space loss to 1 m is about 41 dB
+#define LOSS_AT_1M_DB        41
+
+/* d = 10^((P1m - rssi) / (10 n)) = 2^((P1m - rssi) * log2(10) / (10 n)), with n given in tenths */
+#define LOG2_10_Q16          217706
+#define PATH_LOSS_COEF_Q16   (LOG2_10_Q16 / CONFIG_EXAMPLE_PROX_PATH_LOSS_X10)
+#define MAX_DISTANCE_CM      100000
+
+// 2^(k/16) in Q16, k = 0..16
+static const uint32_t exp2_lut[17] = {
+  65536, 68438, 71468, 74632, 77936, 81386, 84990, 88752, 92682,
+  96785, 101070, 105545, 110218, 115098, 120194, 125515, 131072
+};
+
+/* Structure of arrays: the batch kernel walks each column linearly */
+static uint64_t keys[MAX_DEVICES];        // packed BDA | KEY_USED, 0 for a free slot
+static int32_t rssi_q8[MAX_DEVICES];      // filtered RSSI
+static int32_t variance_q8[MAX_DEVICES];
+static int8_t tx_power[MAX_DEVICES];      // expected RSSI at 1 m
+static uint32_t seen_ms[MAX_DEVICES];
+static uint32_t distance_cm[MAX_DEVICES];
+static uint8_t zones[MAX_DEVICES];
+
+static SemaphoreHandle_t prox_lock = NULL;
+static TimerHandle_t kernel_timer = NULL;
+#if CONFIG_EXAMPLE_STATIC_ALLOCATION
+static StaticSemaphore_t prox_lock_buffer;
+static StaticTimer_t kernel_timer_buffer;
+#endif
+
+static struct {
+  uint32_t updates;
+  uint32_t evictions;
+  uint32_t kernel_runs;
+  uint32_t last_kernel_cycles;
+} prox_stats;
+
+static uint64_t pack_bda(esp_bd_addr_t bda) {
+
+  uint64_t key = 0;
+
+  for (int idx = 0; idx < ESP_BD_ADDR_LEN; idx++) {
+    key = (key << 8) | bda[idx];
+  }
+
+  return key | KEY_USED;
+}
+
+static void unpack_bda(uint64_t key, esp_bd_addr_t bda) {
+
+  for (int idx = ESP_BD_ADDR_LEN - 1; idx >= 0; idx--) {
+    bda[idx] = key & 0xFF;
+    key >>= 8;
+  }
+}
+
+static uint32_t now_ms() {
+  return esp_timer_get_time() / 1000;
+}
+
+static int find_slot(uint64_t key) {
+
+  for (int idx = 0; idx < MAX_DEVICES; idx++) {
+    if (keys[idx] == key) {
+      return idx;
+    }
+  }
+
+  return -1;
+}
+
+// A free slot, otherwise the one seen longest ago
+static int claim_slot() {
+
+  int oldest = 0;
+
+  for (int idx = 0; idx < MAX_DEVICES; idx++) {
+    if (keys[idx] == 0) {
+      return idx;
+    }
+    if ((int32_t)(seen_ms[idx] - seen_ms[oldest]) < 0) {
+      oldest = idx;
+    }
+  }
+
+  prox_stats.evictions++;
+  return oldest;
+}
+
+void proximity_update(esp_bd_addr_t bda, int8_t rssi, int8_t tx_power_1m) {
+
+  uint64_t key = pack_bda(bda);
+  int32_t measured_q8 = rssi * 256;
+
+  if (prox_lock == NULL) {
+    return;
+  }
+
+  xSemaphoreTake(prox_lock, portMAX_DELAY);
+  int idx = find_slot(key);
+
+  if (idx < 0) {
+    idx = claim_slot();
+    keys[idx] = key;
+    rssi_q8[idx] = measured_q8;
+    variance_q8[idx] = MEASUREMENT_NOISE_Q8;
+    tx_power[idx] = CONFIG_EXAMPLE_PROX_DEFAULT_TX_POWER;
+    distance_cm[idx] = 0;
+    zones[idx] = PROXIMITY_ZONE_UNKNOWN;
+  }
+  else {
+    // 1-D Kalman filter on a random walk: predict, then correct with gain P / (P + R)
+    int32_t variance = variance_q8[idx] + PROCESS_NOISE_Q8;
+    int32_t gain = (variance << KALMAN_GAIN_BITS) / (variance + MEASUREMENT_NOISE_Q8);
+
+    rssi_q8[idx] += ((measured_q8 - rssi_q8[idx]) * gain) >> KALMAN_GAIN_BITS;
+    variance_q8[idx] = variance - ((variance * gain) >> KALMAN_GAIN_BITS);
+  }
+
+  if (tx_power_1m != PROXIMITY_TX_POWER_UNKNOWN) {
+    tx_power[idx] = tx_power_1m;
+  }
+  seen_ms[idx] = now_ms();
+  prox_stats.updates++;
+  xSemaphoreGive(prox_lock);
+}
+
+int8_t proximity_tx_power_from_adv(uint8_t* adv, const beacon_record_t* beacon) {
+
+  uint8_t len = 0;
+
+  switch (beacon->type) {
+  case BEACON_TYPE_IBEACON:
+    return beacon->ibeacon.measured_power;
+  case BEACON_TYPE_EDDYSTONE_UID:
+    return beacon->eddystone_uid.tx_power - LOSS_AT_1M_DB;
+  case BEACON_TYPE_EDDYSTONE_URL:
+    return beacon->eddystone_url.tx_power - LOSS_AT_1M_DB;
+  default:
+    break;
+  }
+
+  uint8_t* level = esp_ble_resolve_adv_data(adv, ESP_BLE_AD_TYPE_TX_PWR, &len);
+  if (level != NULL && len == 1) {
+    return (int8_t)level[0] - LOSS_AT_1M_DB;
+  }
+
+  return PROXIMITY_TX_POWER_UNKNOWN;
+}
+
+/* Batch kernel: filtered RSSI to distance and zone for the whole table, integer only.
+ * Called with prox_lock held. */
+static void run_distance_kernel() {
+
+  uint32_t now = now_ms();
+
+  for (int idx = 0; idx < MAX_DEVICES; idx++) {
+    // Path loss over 1 m in Q8 dB, then the exponent of 2 in Q16
+    int32_t loss_q8 = tx_power[idx] * 256 - rssi_q8[idx];
+    int32_t exponent_q16 = (loss_q8 * PATH_LOSS_COEF_Q16) >> 8;
+    int32_t whole = exponent_q16 >> 16;
+    uint32_t frac = exponent_q16 & 0xFFFF;
+
+    whole = whole < -15 ? -15 : whole;
+    whole = whole > 10 ? 10 : whole;
+
+    // 2^frac from the table, interpolated between the 16 steps
+    uint32_t step = frac >> 12;
+    uint32_t mantissa_q16 = exp2_lut[step] + (((exp2_lut[step + 1] - exp2_lut[step]) * (frac & 0xFFF)) >> 12);
+    uint32_t cm = (100 * mantissa_q16) >> (16 - whole);
+
+    distance_cm[idx] = cm < MAX_DISTANCE_CM ? cm : MAX_DISTANCE_CM;
+  }
+
+  for (int idx = 0; idx < MAX_DEVICES; idx++) {
+    bool fresh = keys[idx] != 0 && now - seen_ms[idx] < CONFIG_EXAMPLE_PROX_STALE_MS;
+
+    zones[idx] = !fresh ? PROXIMITY_ZONE_UNKNOWN :
+      distance_cm[idx] <= CONFIG_EXAMPLE_PROX_IMMEDIATE_CM ? PROXIMITY_ZONE_IMMEDIATE :
+      distance_cm[idx] <= CONFIG_EXAMPLE_PROX_NEAR_CM ? PROXIMITY_ZONE_NEAR : PROXIMITY_ZONE_FAR;
+  }
+}
+
+static void vTimerCallbackKernel(TimerHandle_t pxTimer) {
+
+  xSemaphoreTake(prox_lock, portMAX_DELAY);
+  uint32_t start_cycles = cpu_hal_get_cycle_count();
+  run_distance_kernel();
+  prox_stats.last_kernel_cycles = cpu_hal_get_cycle_count() - start_cycles;
+  prox_stats.kernel_runs++;
+  xSemaphoreGive(prox_lock);
+}
+
+esp_err_t proximity_init() {
+
+#if CONFIG_EXAMPLE_STATIC_ALLOCATION
+  prox_lock = xSemaphoreCreateMutexStatic(&prox_lock_buffer);
+#else
+  prox_lock = xSemaphoreCreateMutex();
+#endif
+  if (prox_lock == NULL) {
+    ESP_LOGE(TAG, "%s: Unable to create lock", __func__);
+    return ESP_ERR_NO_MEM;
+  }
+
+#if CONFIG_EXAMPLE_STATIC_ALLOCATION
+  kernel_timer = xTimerCreateStatic(
+    "ProxKernel",
+    pdMS_TO_TICKS(CONFIG_EXAMPLE_PROX_UPDATE_MS),
+    pdTRUE, // auto reload
+    (void*)0,
+    vTimerCallbackKernel,
+    &kernel_timer_buffer
+  );
+#else
+  kernel_timer = xTimerCreate(
+    "ProxKernel",
+    pdMS_TO_TICKS(CONFIG_EXAMPLE_PROX_UPDATE_MS),
+    pdTRUE, // auto reload
+    (void*)0,
+    vTimerCallbackKernel
+  );
+#endif
+  if (kernel_timer == NULL || xTimerStart(kernel_timer, 0) != pdPASS) {
+    ESP_LOGE(TAG, "%s: Unable to start kernel timer", __func__);
+    return ESP_FAIL;
+  }
+
+  mem_budget_add("proximity", sizeof(keys) + sizeof(rssi_q8) + sizeof(variance_q8) + sizeof(tx_power) +
+    sizeof(seen_ms) + sizeof(distance_cm) + sizeof(zones));
+
+  return ESP_OK;
+}
+
+bool proximity_nearest(esp_bd_addr_t bda, uint32_t* distance) {
+
+  int nearest = -1;
+
+  xSemaphoreTake(prox_lock, portMAX_DELAY);
+  for (int idx = 0; idx < MAX_DEVICES; idx++) {
+    if (zones[idx] != PROXIMITY_ZONE_UNKNOWN && (nearest < 0 || distance_cm[idx] < distance_cm[nearest])) {
+      nearest = idx;
+    }
+  }
+  if (nearest >= 0) {
+    unpack_bda(keys[nearest], bda);
+    *distance = distance_cm[nearest];
+  }
+  xSemaphoreGive(prox_lock);
+
+  return nearest >= 0;
+}
+
+proximity_zone_t proximity_get_zone(esp_bd_addr_t bda) {
+
+  proximity_zone_t zone = PROXIMITY_ZONE_UNKNOWN;
+
+  xSemaphoreTake(prox_lock, portMAX_DELAY);
+  int idx = find_slot(pack_bda(bda));
+  if (idx >= 0) {
+    zone = zones[idx];
+  }
+  xSemaphoreGive(prox_lock);
+
+  return zone;
+}
+
+int proximity_zone_members(proximity_zone_t zone, esp_bd_addr_t* bdas, int max) {
+
+  int count = 0;
+
+  xSemaphoreTake(prox_lock, portMAX_DELAY);
+  for (int idx = 0; idx < MAX_DEVICES; idx++) {
+    if (keys[idx] != 0 && zones[idx] == zone) {
+      if (count < max) {
+        unpack_bda(keys[idx], bdas[count]);
+      }
+      count++;
+    }
+  }
+  xSemaphoreGive(prox_lock);
+
+  return count;
+}
+
+const char* proximity_zone_name(proximity_zone_t zone) {
+
+  switch (zone) {
+  case PROXIMITY_ZONE_IMMEDIATE:
+    return "immediate";
+  case PROXIMITY_ZONE_NEAR:
+    return "near";
+  case PROXIMITY_ZONE_FAR:
+    return "far";
+  default:
+    return "unknown";
+  }
+}
+
+void display_proximity() {
+
+  esp_bd_addr_t bda;
+
+  printf("Proximity\n");
+  xSemaphoreTake(prox_lock, portMAX_DELAY);
+  for (int idx = 0; idx < MAX_DEVICES; idx++) {
+    if (zones[idx] == PROXIMITY_ZONE_UNKNOWN) {
+      continue;
+    }
+    unpack_bda(keys[idx], bda);
+    printf("%02x:%02x:%02x:%02x:%02x:%02x rssi %d.%02d dBm, 1 m %d dBm, %u.%02u m, %s\n",
+      bda[0], bda[1], bda[2], bda[3], bda[4], bda[5],
+      rssi_q8[idx] / 256, (abs(rssi_q8[idx]) % 256) * 100 / 256, tx_power[idx],
+      distance_cm[idx] / 100, distance_cm[idx] % 100, proximity_zone_name(zones[idx]));
+  }
+  printf("Updates %u, evictions %u, kernel runs %u, last %u cycles for %d slots\n", prox_stats.updates,
+    prox_stats.evictions, prox_stats.kernel_runs, prox_stats.last_kernel_cycles, MAX_DEVICES);
+  xSemaphoreGive(prox_lock);
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "esp_err.h"
+#include "esp_gap_ble_api.h"
+#include "beacon.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PROXIMITY_TX_POWER_UNKNOWN INT8_MIN
+
+  typedef enum {
+    PROXIMITY_ZONE_UNKNOWN = 0,   // not seen recently
+    PROXIMITY_ZONE_IMMEDIATE,
+    PROXIMITY_ZONE_NEAR,
+    PROXIMITY_ZONE_FAR,
+  } proximity_zone_t;
+
+  esp_err_t proximity_init();
+  /* Feed one sighting through the device's RSSI filter. tx_power_1m is the expected RSSI at 1 m,
+   * PROXIMITY_TX_POWER_UNKNOWN keeps the last known value. */
+  void proximity_update(esp_bd_addr_t bda, int8_t rssi, int8_t tx_power_1m);
+  /* Expected RSSI at 1 m from the beacon record or the TX power AD type, PROXIMITY_TX_POWER_UNKNOWN if neither */
+  int8_t proximity_tx_power_from_adv(uint8_t* adv, const beacon_record_t* beacon);
+
+  /* Queries see the distances of the last batch run, every CONFIG_EXAMPLE_PROX_UPDATE_MS */
+  bool proximity_nearest(esp_bd_addr_t bda, uint32_t* distance_cm);
+  proximity_zone_t proximity_get_zone(esp_bd_addr_t bda);
+  /* Copies up to max addresses of the devices in the zone, returns how many there are */
+  int proximity_zone_members(proximity_zone_t zone, esp_bd_addr_t* bdas, int max);
+  const char* proximity_zone_name(proximity_zone_t zone);
+  void display_proximity();
+
+
+#ifdef __cplusplus
+}
+#endif
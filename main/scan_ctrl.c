@@ -0,0 +1,397 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "sdkconfig.h"
+
+#if CONFIG_EXAMPLE_SCAN_CTRL
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/timers.h"
+#include "list.h"
+#include "scan_feed.h"
+#include "scan_ctrl.h"
+#include "mem_budget.h"
+
+#define TAG "SCAN_CTRL"
+
+/* Duty cycle steps between the configured bounds. Level 0 pairs the shortest window with the
+ * longest interval, the top level the longest window with the shortest interval. */
+#define LEVELS              8
+#define RAMP_STEP           2
+// Restarting for less than this is not worth the gap in scanning
+#define MIN_REMAINING_US    2000000LL
+// Quiet and almost every report a repeat, scan responses bring nothing new
+#define PASSIVE_UNCHANGED_PCT 90
+
+// BLE scan timing is in units of 0.625 ms
+#define MS_TO_UNITS(ms)     ((ms) * 8 / 5)
+#define UNITS_TO_MS(units)  ((units) * 5 / 8)
+
+typedef enum {
+  CTRL_IDLE = 0,
+  CTRL_SCANNING,
+  CTRL_STOPPING,        // waiting for the scan to stop before setting new parameters
+  CTRL_SETTING,         // waiting for the parameters before restarting
+} ctrl_state_t;
+
+static ctrl_state_t state = CTRL_IDLE;
+static bool cancelled = false;
+static esp_ble_scan_params_t params;
+static int64_t deadline_us;
+static uint8_t level;
+static bool active;
+static uint8_t quiet_periods;
+static scan_counters_t last_counters;
+static uint32_t last_dropped;
+static int64_t last_sample_us;
+static scan_ctrl_metrics_t metrics;
+static SemaphoreHandle_t ctrl_lock = NULL;
+static TimerHandle_t ctrl_timer = NULL;
+#if CONFIG_EXAMPLE_STATIC_ALLOCATION
+static StaticSemaphore_t ctrl_lock_buffer;
+static StaticTimer_t ctrl_timer_buffer;
+#endif
+
+static void level_timing(uint8_t lvl, uint16_t* window, uint16_t* interval) {
+
+  uint16_t min_window = MS_TO_UNITS(CONFIG_EXAMPLE_SCAN_CTRL_MIN_WINDOW_MS);
+  uint16_t max_window = MS_TO_UNITS(CONFIG_EXAMPLE_SCAN_CTRL_MAX_WINDOW_MS);
+  uint16_t min_interval = MS_TO_UNITS(CONFIG_EXAMPLE_SCAN_CTRL_MIN_INTERVAL_MS);
+  uint16_t max_interval = MS_TO_UNITS(CONFIG_EXAMPLE_SCAN_CTRL_MAX_INTERVAL_MS);
+
+  *window = min_window + (max_window - min_window) * lvl / LEVELS;
+  *interval = max_interval - (max_interval - min_interval) * lvl / LEVELS;
+  if (*window > *interval) {
+    *window = *interval;
+  }
+}
+
+// Window / interval in per mille
+static uint32_t level_duty(uint8_t lvl) {
+
+  uint16_t window, interval;
+
+  level_timing(lvl, &window, &interval);
+  return window * 1000 / interval;
+}
+
+// Level whose duty cycle, in per mille, is closest to target
+static uint8_t nearest_level(uint32_t target) {
+
+  uint32_t best_diff = UINT32_MAX;
+  uint8_t best = 0;
+
+  for (uint8_t lvl = 0; lvl <= LEVELS; lvl++) {
+    uint32_t duty = level_duty(lvl);
+    uint32_t diff = duty > target ? duty - target : target - duty;
+    if (diff < best_diff) {
+      best_diff = diff;
+      best = lvl;
+    }
+  }
+
+  return best;
+}
+
+// Called with ctrl_lock held
+static void sample(const scan_counters_t* counters, uint32_t dropped, int64_t now) {
+
+  last_counters = *counters;
+  last_dropped = dropped;
+  last_sample_us = now;
+}
+
+static void vTimerCallbackControl(TimerHandle_t pxTimer) {
+
+  scan_counters_t counters;
+  uint32_t dropped;
+  int64_t now = esp_timer_get_time();
+  bool stop = false;
+
+  get_scan_counters(&counters);
+  uint8_t backlog = scan_feed_get_backlog(&dropped);
+
+  xSemaphoreTake(ctrl_lock, portMAX_DELAY);
+
+  if (state == CTRL_SCANNING && now >= deadline_us) {
+    state = CTRL_IDLE;
+  }
+  if (state != CTRL_SCANNING || now <= last_sample_us) {
+    sample(&counters, dropped, now);
+    xSemaphoreGive(ctrl_lock);
+    return;
+  }
+
+  uint32_t reports = counters.reports - last_counters.reports;
+  uint32_t unchanged = counters.unchanged - last_counters.unchanged;
+  uint32_t new_devices = counters.new_devices - last_counters.new_devices;
+  uint64_t cycles = counters.cycles - last_counters.cycles;
+  uint32_t drops = dropped > last_dropped ? dropped - last_dropped : 0;
+  int64_t period_us = now - last_sample_us;
+
+  metrics.report_rate = (uint64_t)reports * 1000000 / period_us;
+  metrics.new_devices = new_devices;
+  metrics.unchanged_pct = reports ? unchanged * 100 / reports : 0;
+  metrics.backlog_pct = backlog;
+  metrics.load_pct = cycles * 100 / ((uint64_t)period_us * CONFIG_ESP32_DEFAULT_CPU_FREQ_MHZ);
+  sample(&counters, dropped, now);
+
+  uint8_t new_level = level;
+  bool new_active = active;
+  const char* reason;
+
+  // Saturated ingest: scan requests go first as they double the reports of scannable devices
+  if (drops > 0 || backlog >= CONFIG_EXAMPLE_SCAN_CTRL_MAX_BACKLOG_PCT ||
+    metrics.load_pct >= CONFIG_EXAMPLE_SCAN_CTRL_MAX_LOAD_PCT) {
+    metrics.backoffs++;
+    quiet_periods = 0;
+    reason = "back off";
+    if (active) {
+      new_active = false;
+    }
+    else if (level > 0) {
+      // Halve the duty cycle, at least one level down
+      new_level = nearest_level(level_duty(level) / 2);
+      if (new_level >= level) {
+        new_level = level - 1;
+      }
+    }
+  }
+  else if (new_devices >= CONFIG_EXAMPLE_SCAN_CTRL_RAMP_NEW_DEVICES) {
+    // Newcomers need a scan response for their name
+    metrics.ramp_ups++;
+    quiet_periods = 0;
+    reason = "ramp up";
+    new_level = level + RAMP_STEP > LEVELS ? LEVELS : level + RAMP_STEP;
+#if CONFIG_EXAMPLE_SCAN_CTRL_ACTIVE
+    new_active = true;
+#endif
+  }
+  else if (new_devices == 0 && ++quiet_periods >= CONFIG_EXAMPLE_SCAN_CTRL_QUIET_PERIODS) {
+    metrics.decays++;
+    quiet_periods = 0;
+    reason = "quiet";
+    if (level > 0) {
+      new_level = level - 1;
+    }
+    if (metrics.unchanged_pct >= PASSIVE_UNCHANGED_PCT) {
+      new_active = false;
+    }
+  }
+  else {
+    metrics.holds++;
+    reason = "hold";
+  }
+#if !CONFIG_EXAMPLE_SCAN_CTRL_ACTIVE
+  new_active = false;
+#endif
+
+  if ((new_level != level || new_active != active) && deadline_us - now >= MIN_REMAINING_US) {
+    uint16_t window, interval;
+
+    level_timing(new_level, &window, &interval);
+    ESP_LOGI(TAG, "%s: level %d -> %d, window %d ms, interval %d ms, %s, %u reports/s, %u new", reason,
+      level, new_level, UNITS_TO_MS(window), UNITS_TO_MS(interval), new_active ? "active" : "passive",
+      metrics.report_rate, new_devices);
+    level = new_level;
+    active = new_active;
+    params.scan_window = window;
+    params.scan_interval = interval;
+    params.scan_type = active ? BLE_SCAN_TYPE_ACTIVE : BLE_SCAN_TYPE_PASSIVE;
+    metrics.retunes++;
+    state = CTRL_STOPPING;
+    cancelled = false;
+    stop = true;
+  }
+
+  xSemaphoreGive(ctrl_lock);
+
+  if (stop) {
+    esp_ble_gap_stop_scanning();
+  }
+}
+
+esp_err_t scan_ctrl_init() {
+
+#if CONFIG_EXAMPLE_STATIC_ALLOCATION
+  ctrl_lock = xSemaphoreCreateMutexStatic(&ctrl_lock_buffer);
+#else
+  ctrl_lock = xSemaphoreCreateMutex();
+#endif
+  if (ctrl_lock == NULL) {
+    ESP_LOGE(TAG, "%s: Unable to create lock", __func__);
+    return ESP_ERR_NO_MEM;
+  }
+
+#if CONFIG_EXAMPLE_STATIC_ALLOCATION
+  ctrl_timer = xTimerCreateStatic(
+    "ScanCtrl",
+    pdMS_TO_TICKS(CONFIG_EXAMPLE_SCAN_CTRL_PERIOD_MS),
+    pdTRUE, // auto reload
+    (void*)0,
+    vTimerCallbackControl,
+    &ctrl_timer_buffer
+  );
+  mem_budget_add("scan_ctrl", sizeof(ctrl_lock_buffer) + sizeof(ctrl_timer_buffer));
+#else
+  ctrl_timer = xTimerCreate(
+    "ScanCtrl",
+    pdMS_TO_TICKS(CONFIG_EXAMPLE_SCAN_CTRL_PERIOD_MS),
+    pdTRUE, // auto reload
+    (void*)0,
+    vTimerCallbackControl
+  );
+#endif
+  if (ctrl_timer == NULL || xTimerStart(ctrl_timer, 0) != pdPASS) {
+    ESP_LOGE(TAG, "%s: Unable to start control timer", __func__);
+    return ESP_FAIL;
+  }
+
+  return ESP_OK;
+}
+
+void scan_ctrl_on_scan_started(const esp_ble_scan_params_t* scan_params, uint32_t duration) {
+
+  scan_counters_t counters;
+  uint32_t dropped;
+
+  if (ctrl_lock == NULL) {
+    return;
+  }
+
+  get_scan_counters(&counters);
+  scan_feed_get_backlog(&dropped);
+
+  xSemaphoreTake(ctrl_lock, portMAX_DELAY);
+  params = *scan_params;
+  level = nearest_level(scan_params->scan_window * 1000 / scan_params->scan_interval);
+  active = scan_params->scan_type == BLE_SCAN_TYPE_ACTIVE;
+  quiet_periods = 0;
+  deadline_us = esp_timer_get_time() + duration * 1000000LL;
+  state = CTRL_SCANNING;
+  cancelled = false;
+  sample(&counters, dropped, esp_timer_get_time());
+  xSemaphoreGive(ctrl_lock);
+}
+
+void scan_ctrl_stop() {
+
+  bool stop = false;
+
+  if (ctrl_lock != NULL) {
+    xSemaphoreTake(ctrl_lock, portMAX_DELAY);
+    // A restart in progress is dropped when its next step completes, the scan is already stopping or stopped
+    if (state == CTRL_STOPPING || state == CTRL_SETTING) {
+      cancelled = true;
+    }
+    else {
+      state = CTRL_IDLE;
+      stop = true;
+    }
+    xSemaphoreGive(ctrl_lock);
+  }
+
+  if (stop) {
+    esp_ble_gap_stop_scanning();
+  }
+}
+
+bool scan_ctrl_on_scan_stopped() {
+
+  bool set = false;
+
+  if (ctrl_lock == NULL) {
+    return false;
+  }
+
+  xSemaphoreTake(ctrl_lock, portMAX_DELAY);
+  if (state != CTRL_STOPPING) {
+    xSemaphoreGive(ctrl_lock);
+    return false;
+  }
+  if (cancelled) {
+    state = CTRL_IDLE;
+  }
+  else {
+    state = CTRL_SETTING;
+    set = true;
+  }
+  xSemaphoreGive(ctrl_lock);
+
+  if (set && esp_ble_gap_set_scan_params(&params) != ESP_OK) {
+    ESP_LOGE(TAG, "%s: Unable to set scan params", __func__);
+    xSemaphoreTake(ctrl_lock, portMAX_DELAY);
+    state = CTRL_IDLE;
+    xSemaphoreGive(ctrl_lock);
+  }
+
+  return true;
+}
+
+bool scan_ctrl_on_params_set() {
+
+  uint32_t remaining = 0;
+
+  if (ctrl_lock == NULL) {
+    return false;
+  }
+
+  xSemaphoreTake(ctrl_lock, portMAX_DELAY);
+  if (state != CTRL_SETTING) {
+    xSemaphoreGive(ctrl_lock);
+    return false;
+  }
+  if (cancelled) {
+    state = CTRL_IDLE;
+  }
+  else {
+    // The stack takes whole seconds, rounded up so retunes don't shorten the scan
+    int64_t left_us = deadline_us - esp_timer_get_time();
+    remaining = left_us > 0 ? (left_us + 999999) / 1000000 : 0;
+    state = remaining > 0 ? CTRL_SCANNING : CTRL_IDLE;
+  }
+  xSemaphoreGive(ctrl_lock);
+
+  if (remaining > 0) {
+    esp_ble_gap_start_scanning(remaining);
+  }
+
+  return true;
+}
+
+void scan_ctrl_get_metrics(scan_ctrl_metrics_t* out) {
+
+  uint16_t window, interval;
+
+  xSemaphoreTake(ctrl_lock, portMAX_DELAY);
+  *out = metrics;
+  out->level = level;
+  out->active = active;
+  xSemaphoreGive(ctrl_lock);
+
+  level_timing(out->level, &window, &interval);
+  out->window_ms = UNITS_TO_MS(window);
+  out->interval_ms = UNITS_TO_MS(interval);
+}
+
+void display_scan_ctrl_stats() {
+
+  scan_ctrl_metrics_t m;
+
+  if (ctrl_lock == NULL) {
+    return;
+  }
+
+  scan_ctrl_get_metrics(&m);
+  printf("Scan control level %d/%d, window %d ms, interval %d ms, %s\n", m.level, LEVELS,
+    m.window_ms, m.interval_ms, m.active ? "active" : "passive");
+  printf("Last period: %u reports/s, %u new devices, %d%% unchanged, backlog %d%%, load %d%%\n",
+    m.report_rate, m.new_devices, m.unchanged_pct, m.backlog_pct, m.load_pct);
+  printf("Decisions: ramp up %u, back off %u, quiet %u, hold %u, retunes %u\n",
+    m.ramp_ups, m.backoffs, m.decays, m.holds, m.retunes);
+}
+
+#endif
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "esp_err.h"
+#include "esp_gap_ble_api.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+  typedef struct {
+    uint8_t level;            // 0 is the lowest duty cycle
+    bool active;
+    uint16_t window_ms;
+    uint16_t interval_ms;
+    uint32_t report_rate;     // reports per second over the last period
+    uint32_t new_devices;     // in the last period
+    uint8_t unchanged_pct;
+    uint8_t backlog_pct;
+    uint8_t load_pct;         // share of CPU time spent handling reports
+    uint32_t ramp_ups;
+    uint32_t backoffs;
+    uint32_t decays;
+    uint32_t holds;
+    uint32_t retunes;         // scans restarted with new parameters
+  } scan_ctrl_metrics_t;
+
+  esp_err_t scan_ctrl_init();
+  /* Call right after esp_ble_gap_start_scanning, duration in seconds as passed to it.
+   * The controller starts from the duty cycle closest to params. */
+  void scan_ctrl_on_scan_started(const esp_ble_scan_params_t* params, uint32_t duration);
+  /* Stop scanning through here so the controller doesn't restart it */
+  void scan_ctrl_stop();
+  /* Retuning stops the scan, sets the new parameters and starts it again for the remaining time.
+   * Feed the GAP completion events through these, they return true if the event was the controller's. */
+  bool scan_ctrl_on_scan_stopped();
+  bool scan_ctrl_on_params_set();
+  void scan_ctrl_get_metrics(scan_ctrl_metrics_t* metrics);
+  void display_scan_ctrl_stats();
+
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,227 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/semphr.h"
+#include "freertos/timers.h"
+#include "scan_feed.h"
+#include "mem_budget.h"
+
+#define TAG "SCAN_FEED"
+
+typedef struct {
+  QueueHandle_t queue;
+  scan_feed_filter_t filter;
+  scan_feed_batch_t pending;
+  uint32_t dropped;
+} scan_feed_subscriber_t;
+
+static scan_feed_subscriber_t subscribers[CONFIG_EXAMPLE_SCAN_FEED_MAX_SUBSCRIBERS];
+static SemaphoreHandle_t feed_lock = NULL;
+static TimerHandle_t flush_timer = NULL;
+#if CONFIG_EXAMPLE_STATIC_ALLOCATION
+static StaticSemaphore_t feed_lock_buffer;
+static StaticTimer_t flush_timer_buffer;
+// One queue per subscriber slot, re-created in place on every subscribe
+static StaticQueue_t queue_buffers[CONFIG_EXAMPLE_SCAN_FEED_MAX_SUBSCRIBERS];
+static uint8_t queue_storage[CONFIG_EXAMPLE_SCAN_FEED_MAX_SUBSCRIBERS][CONFIG_EXAMPLE_SCAN_FEED_QUEUE_LEN * sizeof(scan_feed_batch_t)];
+#endif
+
+static bool filter_match(const scan_feed_filter_t* filter, uint8_t events, const scan_results_list_t* device) {
+
+  if ((filter->events & events) == 0) {
+    return false;
+  }
+  if (!(events & SCAN_FEED_DEVICE_LOST) && device->data.rssi < filter->min_rssi) {
+    return false;
+  }
+  if (filter->beacons_only && device->beacon.type == BEACON_TYPE_NONE) {
+    return false;
+  }
+  if (filter->name != NULL && strcmp(filter->name, device->dev_name) != 0) {
+    return false;
+  }
+
+  return true;
+}
+
+// Called with feed_lock held
+static void flush_subscriber(scan_feed_subscriber_t* sub) {
+
+  if (sub->pending.count == 0) {
+    return;
+  }
+
+  if (xQueueSend(sub->queue, &sub->pending, 0) != pdPASS) {
+    sub->dropped++;
+    ESP_LOGW(TAG, "subscriber queue full, dropped %d events", sub->pending.count);
+  }
+  sub->pending.count = 0;
+}
+
+static void lost_device_cb(const scan_results_list_t* device) {
+  scan_feed_publish(SCAN_FEED_DEVICE_LOST, device);
+}
+
+static void vTimerCallbackFlush(TimerHandle_t pxTimer) {
+
+  sweep_lost_devices(esp_timer_get_time() - CONFIG_EXAMPLE_SCAN_FEED_LOST_TIMEOUT_MS * 1000LL, lost_device_cb);
+
+  xSemaphoreTake(feed_lock, portMAX_DELAY);
+  for (int idx = 0; idx < CONFIG_EXAMPLE_SCAN_FEED_MAX_SUBSCRIBERS; idx++) {
+    if (subscribers[idx].queue != NULL) {
+      flush_subscriber(&subscribers[idx]);
+    }
+  }
+  xSemaphoreGive(feed_lock);
+}
+
+esp_err_t scan_feed_init() {
+
+#if CONFIG_EXAMPLE_STATIC_ALLOCATION
+  feed_lock = xSemaphoreCreateMutexStatic(&feed_lock_buffer);
+#else
+  feed_lock = xSemaphoreCreateMutex();
+#endif
+  if (feed_lock == NULL) {
+    ESP_LOGE(TAG, "%s: Unable to create lock", __func__);
+    return ESP_ERR_NO_MEM;
+  }
+
+#if CONFIG_EXAMPLE_STATIC_ALLOCATION
+  flush_timer = xTimerCreateStatic(
+    "ScanFeedFlush",
+    pdMS_TO_TICKS(CONFIG_EXAMPLE_SCAN_FEED_FLUSH_MS),
+    pdTRUE, // auto reload
+    (void*)0,
+    vTimerCallbackFlush,
+    &flush_timer_buffer
+  );
+  mem_budget_add("scan_feed", sizeof(subscribers) + sizeof(feed_lock_buffer) + sizeof(flush_timer_buffer) +
+    sizeof(queue_buffers) + sizeof(queue_storage));
+#else
+  flush_timer = xTimerCreate(
+    "ScanFeedFlush",
+    pdMS_TO_TICKS(CONFIG_EXAMPLE_SCAN_FEED_FLUSH_MS),
+    pdTRUE, // auto reload
+    (void*)0,
+    vTimerCallbackFlush
+  );
+  mem_budget_add("scan_feed", sizeof(subscribers));
+#endif
+  if (flush_timer == NULL || xTimerStart(flush_timer, 0) != pdPASS) {
+    ESP_LOGE(TAG, "%s: Unable to start flush timer", __func__);
+    return ESP_FAIL;
+  }
+
+  return ESP_OK;
+}
+
+QueueHandle_t scan_feed_subscribe(const scan_feed_filter_t* filter) {
+
+  QueueHandle_t queue = NULL;
+
+  xSemaphoreTake(feed_lock, portMAX_DELAY);
+  for (int idx = 0; idx < CONFIG_EXAMPLE_SCAN_FEED_MAX_SUBSCRIBERS; idx++) {
+    if (subscribers[idx].queue == NULL) {
+#if CONFIG_EXAMPLE_STATIC_ALLOCATION
+      queue = xQueueCreateStatic(CONFIG_EXAMPLE_SCAN_FEED_QUEUE_LEN, sizeof(scan_feed_batch_t),
+        queue_storage[idx], &queue_buffers[idx]);
+#else
+      queue = xQueueCreate(CONFIG_EXAMPLE_SCAN_FEED_QUEUE_LEN, sizeof(scan_feed_batch_t));
+#endif
+      if (queue != NULL) {
+        subscribers[idx].queue = queue;
+        subscribers[idx].filter = *filter;
+        subscribers[idx].pending.count = 0;
+        subscribers[idx].dropped = 0;
+      }
+      break;
+    }
+  }
+  xSemaphoreGive(feed_lock);
+
+  if (queue == NULL) {
+    ESP_LOGE(TAG, "%s: No subscriber slot left", __func__);
+  }
+
+  return queue;
+}
+
+void scan_feed_unsubscribe(QueueHandle_t queue) {
+
+  xSemaphoreTake(feed_lock, portMAX_DELAY);
+  for (int idx = 0; idx < CONFIG_EXAMPLE_SCAN_FEED_MAX_SUBSCRIBERS; idx++) {
+    if (subscribers[idx].queue == queue) {
+      subscribers[idx].queue = NULL;
+      vQueueDelete(queue);
+      break;
+    }
+  }
+  xSemaphoreGive(feed_lock);
+}
+
+uint8_t scan_feed_get_backlog(uint32_t* dropped) {
+
+  uint8_t backlog = 0;
+
+  *dropped = 0;
+  if (feed_lock == NULL) {
+    return 0;
+  }
+
+  xSemaphoreTake(feed_lock, portMAX_DELAY);
+  for (int idx = 0; idx < CONFIG_EXAMPLE_SCAN_FEED_MAX_SUBSCRIBERS; idx++) {
+    if (subscribers[idx].queue != NULL) {
+      uint8_t fill = uxQueueMessagesWaiting(subscribers[idx].queue) * 100 / CONFIG_EXAMPLE_SCAN_FEED_QUEUE_LEN;
+
+      if (fill > backlog) {
+        backlog = fill;
+      }
+      *dropped += subscribers[idx].dropped;
+    }
+  }
+  xSemaphoreGive(feed_lock);
+
+  return backlog;
+}
+
+void scan_feed_publish(uint8_t events, const scan_results_list_t* device) {
+
+  if (feed_lock == NULL) {
+    return;
+  }
+
+  xSemaphoreTake(feed_lock, portMAX_DELAY);
+  for (int idx = 0; idx < CONFIG_EXAMPLE_SCAN_FEED_MAX_SUBSCRIBERS; idx++) {
+    scan_feed_subscriber_t* sub = &subscribers[idx];
+
+    if (sub->queue == NULL || !filter_match(&sub->filter, events, device)) {
+      continue;
+    }
+
+    // Coalesce with a pending event of the same device
+    scan_feed_entry_t* entry = NULL;
+    for (int j = 0; j < sub->pending.count; j++) {
+      if (memcmp(sub->pending.entries[j].bda, device->data.bda, sizeof(esp_bd_addr_t)) == 0) {
+        entry = &sub->pending.entries[j];
+        break;
+      }
+    }
+
+    if (entry == NULL) {
+      if (sub->pending.count == CONFIG_EXAMPLE_SCAN_FEED_BATCH_SIZE) {
+        flush_subscriber(sub);
+      }
+      entry = &sub->pending.entries[sub->pending.count++];
+      memcpy(entry->bda, device->data.bda, sizeof(esp_bd_addr_t));
+      entry->events = 0;
+    }
+
+    entry->addr_type = device->data.ble_addr_type;
+    entry->rssi = device->data.rssi;
+    entry->events |= events & sub->filter.events;
+  }
+  xSemaphoreGive(feed_lock);
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "esp_gap_ble_api.h"
+#include "list.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+  typedef enum {
+    SCAN_FEED_DEVICE_ADDED    = (1 << 0),
+    SCAN_FEED_RSSI_CHANGED    = (1 << 1),
+    SCAN_FEED_PAYLOAD_CHANGED = (1 << 2),
+    SCAN_FEED_DEVICE_LOST     = (1 << 3),
+  } scan_feed_event_t;
+
+#define SCAN_FEED_ALL_EVENTS (SCAN_FEED_DEVICE_ADDED | SCAN_FEED_RSSI_CHANGED | SCAN_FEED_PAYLOAD_CHANGED | SCAN_FEED_DEVICE_LOST)
+
+  typedef struct {
+    uint8_t events;           // mask of scan_feed_event_t
+    int8_t min_rssi;          // lost events are delivered regardless of RSSI
+    bool beacons_only;
+    const char* name;         // exact device name, NULL for any
+  } scan_feed_filter_t;
+
+  typedef struct {
+    esp_bd_addr_t bda;
+    esp_ble_addr_type_t addr_type;
+    int8_t rssi;
+    uint8_t events;           // all events coalesced since the last batch
+  } scan_feed_entry_t;
+
+  typedef struct {
+    uint8_t count;
+    scan_feed_entry_t entries[CONFIG_EXAMPLE_SCAN_FEED_BATCH_SIZE];
+  } scan_feed_batch_t;
+
+  esp_err_t scan_feed_init();
+  /* Returns a queue of scan_feed_batch_t, or NULL if no subscriber slot is left */
+  QueueHandle_t scan_feed_subscribe(const scan_feed_filter_t* filter);
+  void scan_feed_unsubscribe(QueueHandle_t queue);
+  void scan_feed_publish(uint8_t events, const scan_results_list_t* device);
+  /* Fill of the fullest subscriber queue in percent, dropped is the number of batches lost so far */
+  uint8_t scan_feed_get_backlog(uint32_t* dropped);
+
+
+#ifdef __cplusplus
+}
+#endif
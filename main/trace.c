@@ -0,0 +1,547 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "sdkconfig.h"
+
+#if CONFIG_EXAMPLE_TRACE
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_partition.h"
+#include "esp_spi_flash.h"
+#include "nvs.h"
+#include "driver/uart.h"
+#include "hal/cpu_hal.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "trace.h"
+#include "mem_budget.h"
+
+#define TAG "TRACE"
+
+#define RING_SIZE CONFIG_EXAMPLE_TRACE_RING_SIZE
+_Static_assert((RING_SIZE & (RING_SIZE - 1)) == 0, "trace ring size must be a power of two");
+
+#define TRACE_REC_SCAN_RESULT 1
+#define TRACE_REC_GATTC_EVENT 2
+
+#define GATTC_VALUE_MAX  64
+#define OUT_BUF_SIZE     512
+#define FLUSH_TASK_STACK 2048
+
+/* btsnoop timestamps count microseconds from year 0, records are stamped with the time since boot
+ * so a capture starts at 1970-01-01 */
+#define BTSNOOP_EPOCH_DELTA_US 0x00dcddb30f2f8000ULL
+#define BTSNOOP_DATALINK_H4    1002
+#define BTSNOOP_FLAGS_EVENT_RX 0x03
+#define H4_TYPE_EVENT          0x04
+#define HCI_EVT_LE_META        0x3E
+#define HCI_EVT_VENDOR         0xFF
+#define HCI_LE_ADV_REPORT      0x02
+#define HCI_ADV_TYPE_SCAN_RSP  0x04
+
+#define COMPACT_MAGIC   "ADVTRACE"
+#define COMPACT_VERSION 1
+
+#define NVS_NAMESPACE "trace"
+#define NVS_KEY_HALF  "half"
+
+/* Ring record header, also the record layout of the compact format (little endian) */
+typedef struct __attribute__((packed)) {
+  uint16_t len;               // payload bytes following the header
+  uint8_t type;
+  uint8_t reserved;
+  uint32_t drops;             // records dropped before this one since boot
+  int64_t timestamp_us;
+} trace_rec_hdr_t;
+
+typedef struct __attribute__((packed)) {
+  esp_bd_addr_t bda;
+  uint8_t addr_type;
+  uint8_t evt_type;
+  int8_t rssi;
+  uint8_t adv_data_len;
+  uint8_t scan_rsp_len;
+  // adv data followed by scan response
+} trace_scan_result_t;
+
+typedef struct __attribute__((packed)) {
+  uint8_t event;
+  uint8_t status;
+  uint16_t conn_id;
+  uint16_t handle;
+  // value, at most GATTC_VALUE_MAX bytes
+} trace_gattc_event_t;
+
+typedef struct {
+  uint32_t records;
+  uint32_t bytes_written;
+  uint32_t bytes_lost;        // sink full or write errors
+  uint64_t record_cycles;
+  uint32_t max_record_cycles;
+} trace_stats_t;
+
+static uint8_t ring[RING_SIZE];
+static uint32_t ring_head;    // written by the producer only
+static uint32_t ring_tail;    // written by the flush task only
+static uint32_t ring_drops;
+
+static uint8_t out_buf[OUT_BUF_SIZE];
+static size_t out_len;
+static trace_stats_t trace_stats;
+static bool trace_enabled = false;   // set once the sink and the flush task are up
+#if CONFIG_EXAMPLE_STATIC_ALLOCATION
+static StackType_t flush_task_stack[FLUSH_TASK_STACK];
+static StaticTask_t flush_task_buffer;
+#endif
+
+#if CONFIG_EXAMPLE_TRACE_SINK_FLASH
+static const esp_partition_t* trace_partition;
+static uint8_t flash_half;          // half of the partition this boot writes, the other keeps the last capture
+static size_t flash_half_size;
+static size_t flash_write_offset;
+static size_t flash_erased_end;
+static size_t flash_end;
+#endif
+
+static void ring_write(uint32_t pos, const void* src, size_t len) {
+
+  uint32_t offset = pos & (RING_SIZE - 1);
+  size_t first = len < RING_SIZE - offset ? len : RING_SIZE - offset;
+
+  memcpy(&ring[offset], src, first);
+  memcpy(&ring[0], (const uint8_t*)src + first, len - first);
+}
+
+static void ring_read(uint32_t pos, void* dst, size_t len) {
+
+  uint32_t offset = pos & (RING_SIZE - 1);
+  size_t first = len < RING_SIZE - offset ? len : RING_SIZE - offset;
+
+  memcpy(dst, &ring[offset], first);
+  memcpy((uint8_t*)dst + first, &ring[0], len - first);
+}
+
+// Never blocks: a record that does not fit is counted and dropped
+static void ring_push(uint8_t type, const void* body, size_t body_len, const void* data, size_t data_len) {
+
+  if (!trace_enabled) {
+    return;
+  }
+
+  uint32_t start_cycles = cpu_hal_get_cycle_count();
+  uint32_t head = ring_head;
+  uint32_t tail = __atomic_load_n(&ring_tail, __ATOMIC_ACQUIRE);
+  size_t total = sizeof(trace_rec_hdr_t) + body_len + data_len;
+
+  if (RING_SIZE - (head - tail) < total) {
+    ring_drops++;
+    return;
+  }
+
+  trace_rec_hdr_t hdr = {
+    .len = body_len + data_len,
+    .type = type,
+    .reserved = 0,
+    .drops = ring_drops,
+    .timestamp_us = esp_timer_get_time(),
+  };
+
+  ring_write(head, &hdr, sizeof(hdr));
+  ring_write(head + sizeof(hdr), body, body_len);
+  ring_write(head + sizeof(hdr) + body_len, data, data_len);
+
+  // Publish the record only once its bytes are in place
+  __atomic_store_n(&ring_head, head + total, __ATOMIC_RELEASE);
+
+  uint32_t cycles = cpu_hal_get_cycle_count() - start_cycles;
+  trace_stats.records++;
+  trace_stats.record_cycles += cycles;
+  if (cycles > trace_stats.max_record_cycles) {
+    trace_stats.max_record_cycles = cycles;
+  }
+}
+
+void trace_record_scan_result(const struct ble_scan_result_evt_param* scan_rst) {
+
+  trace_scan_result_t body = {
+    .addr_type = scan_rst->ble_addr_type,
+    .evt_type = scan_rst->ble_evt_type,
+    .rssi = scan_rst->rssi,
+    .adv_data_len = scan_rst->adv_data_len,
+    .scan_rsp_len = scan_rst->scan_rsp_len,
+  };
+
+  memcpy(body.bda, scan_rst->bda, sizeof(esp_bd_addr_t));
+  ring_push(TRACE_REC_SCAN_RESULT, &body, sizeof(body), scan_rst->ble_adv, scan_rst->adv_data_len + scan_rst->scan_rsp_len);
+}
+
+void trace_record_gattc_event(esp_gattc_cb_event_t event, const esp_ble_gattc_cb_param_t* param) {
+
+  trace_gattc_event_t body = {
+    .event = event,
+    .status = ESP_GATT_OK,
+    .conn_id = 0,
+    .handle = 0,
+  };
+  const uint8_t* value = NULL;
+  uint16_t value_len = 0;
+
+  switch (event) {
+  case ESP_GATTC_OPEN_EVT:
+    body.status = param->open.status;
+    body.conn_id = param->open.conn_id;
+    break;
+  case ESP_GATTC_CLOSE_EVT:
+    body.status = param->close.status;
+    body.conn_id = param->close.conn_id;
+    break;
+  case ESP_GATTC_CONNECT_EVT:
+    body.conn_id = param->connect.conn_id;
+    break;
+  case ESP_GATTC_DISCONNECT_EVT:
+    body.status = param->disconnect.reason;
+    body.conn_id = param->disconnect.conn_id;
+    break;
+  case ESP_GATTC_CFG_MTU_EVT:
+    body.status = param->cfg_mtu.status;
+    body.conn_id = param->cfg_mtu.conn_id;
+    body.handle = param->cfg_mtu.mtu;
+    break;
+  case ESP_GATTC_SEARCH_CMPL_EVT:
+    body.status = param->search_cmpl.status;
+    body.conn_id = param->search_cmpl.conn_id;
+    break;
+  case ESP_GATTC_READ_CHAR_EVT:
+  case ESP_GATTC_READ_DESCR_EVT:
+    body.status = param->read.status;
+    body.conn_id = param->read.conn_id;
+    body.handle = param->read.handle;
+    value = param->read.value;
+    value_len = param->read.value_len;
+    break;
+  case ESP_GATTC_WRITE_CHAR_EVT:
+  case ESP_GATTC_WRITE_DESCR_EVT:
+    body.status = param->write.status;
+    body.conn_id = param->write.conn_id;
+    body.handle = param->write.handle;
+    break;
+  case ESP_GATTC_NOTIFY_EVT:
+    body.conn_id = param->notify.conn_id;
+    body.handle = param->notify.handle;
+    value = param->notify.value;
+    value_len = param->notify.value_len;
+    break;
+  case ESP_GATTC_REG_FOR_NOTIFY_EVT:
+    body.status = param->reg_for_notify.status;
+    body.handle = param->reg_for_notify.handle;
+    break;
+  default:
+    // Registration, search results and the like say nothing about the link
+    return;
+  }
+
+  if (value == NULL) {
+    value_len = 0;
+  }
+  if (value_len > GATTC_VALUE_MAX) {
+    value_len = GATTC_VALUE_MAX;
+  }
+  ring_push(TRACE_REC_GATTC_EVENT, &body, sizeof(body), value, value_len);
+}
+
+static void put_be32(uint8_t* dst, uint32_t value) {
+
+  dst[0] = value >> 24;
+  dst[1] = value >> 16;
+  dst[2] = value >> 8;
+  dst[3] = value;
+}
+
+static void sink_write(const uint8_t* data, size_t len) {
+
+#if CONFIG_EXAMPLE_TRACE_SINK_FLASH
+  if (flash_write_offset + len > flash_end) {
+    trace_stats.bytes_lost += len;
+    return;
+  }
+
+  // Erase lazily, one sector ahead of the writes
+  while (flash_write_offset + len > flash_erased_end) {
+    esp_err_t ret = esp_partition_erase_range(trace_partition, flash_erased_end, SPI_FLASH_SEC_SIZE);
+    if (ret != ESP_OK) {
+      ESP_LOGE(TAG, "%s: erase failed: %s", __func__, esp_err_to_name(ret));
+      trace_stats.bytes_lost += len;
+      return;
+    }
+    flash_erased_end += SPI_FLASH_SEC_SIZE;
+  }
+
+  esp_err_t ret = esp_partition_write(trace_partition, flash_write_offset, data, len);
+  if (ret != ESP_OK) {
+    ESP_LOGE(TAG, "%s: write failed: %s", __func__, esp_err_to_name(ret));
+    trace_stats.bytes_lost += len;
+    return;
+  }
+  flash_write_offset += len;
+#else
+  uart_write_bytes(CONFIG_EXAMPLE_TRACE_UART_NUM, data, len);
+#endif
+
+  trace_stats.bytes_written += len;
+}
+
+static void out_flush() {
+
+  if (out_len > 0) {
+    sink_write(out_buf, out_len);
+    out_len = 0;
+  }
+}
+
+static uint8_t* out_reserve(size_t len) {
+
+  if (out_len + len > OUT_BUF_SIZE) {
+    out_flush();
+  }
+
+  uint8_t* dst = &out_buf[out_len];
+  out_len += len;
+  return dst;
+}
+
+#if CONFIG_EXAMPLE_TRACE_FORMAT_BTSNOOP
+
+// One H4 HCI event: packet record header, packet type, event code, parameter length
+static uint8_t* btsnoop_begin_event(const trace_rec_hdr_t* hdr, uint8_t event_code, uint8_t param_len) {
+
+  uint32_t packet_len = 3 + param_len;
+  uint64_t timestamp = hdr->timestamp_us + BTSNOOP_EPOCH_DELTA_US;
+  uint8_t* dst = out_reserve(24 + packet_len);
+
+  put_be32(&dst[0], packet_len);
+  put_be32(&dst[4], packet_len);
+  put_be32(&dst[8], BTSNOOP_FLAGS_EVENT_RX);
+  put_be32(&dst[12], hdr->drops);
+  put_be32(&dst[16], timestamp >> 32);
+  put_be32(&dst[20], timestamp);
+  dst[24] = H4_TYPE_EVENT;
+  dst[25] = event_code;
+  dst[26] = param_len;
+
+  return &dst[27];
+}
+
+// Rebuilds the LE Advertising Report the controller sent, one report per PDU
+static void btsnoop_adv_report(const trace_rec_hdr_t* hdr, const trace_scan_result_t* scan,
+  uint8_t evt_type, const uint8_t* data, uint8_t data_len) {
+
+  uint8_t* dst = btsnoop_begin_event(hdr, HCI_EVT_LE_META, 12 + data_len);
+
+  *dst++ = HCI_LE_ADV_REPORT;
+  *dst++ = 1;   // number of reports
+  *dst++ = evt_type;
+  *dst++ = scan->addr_type;
+  // HCI carries the address least significant byte first
+  for (int idx = 0; idx < sizeof(esp_bd_addr_t); idx++) {
+    *dst++ = scan->bda[sizeof(esp_bd_addr_t) - 1 - idx];
+  }
+  *dst++ = data_len;
+  memcpy(dst, data, data_len);
+  dst[data_len] = scan->rssi;
+}
+
+static void encode_record(const trace_rec_hdr_t* hdr, const uint8_t* payload) {
+
+  if (hdr->type == TRACE_REC_SCAN_RESULT) {
+    const trace_scan_result_t* scan = (const trace_scan_result_t*)payload;
+    const uint8_t* data = payload + sizeof(trace_scan_result_t);
+
+    btsnoop_adv_report(hdr, scan, scan->evt_type, data, scan->adv_data_len);
+    if (scan->scan_rsp_len > 0) {
+      btsnoop_adv_report(hdr, scan, HCI_ADV_TYPE_SCAN_RSP, data + scan->adv_data_len, scan->scan_rsp_len);
+    }
+  }
+  else {
+    // GATT client events have no HCI form, carry them in a vendor specific event
+    uint8_t* dst = btsnoop_begin_event(hdr, HCI_EVT_VENDOR, hdr->len);
+    memcpy(dst, payload, hdr->len);
+  }
+}
+
+static void write_file_header() {
+
+  uint8_t* dst = out_reserve(16);
+
+  memcpy(dst, "btsnoop", 8);
+  put_be32(&dst[8], 1);
+  put_be32(&dst[12], BTSNOOP_DATALINK_H4);
+}
+
+#else
+
+static void encode_record(const trace_rec_hdr_t* hdr, const uint8_t* payload) {
+
+  uint8_t* dst = out_reserve(sizeof(trace_rec_hdr_t) + hdr->len);
+
+  memcpy(dst, hdr, sizeof(trace_rec_hdr_t));
+  memcpy(dst + sizeof(trace_rec_hdr_t), payload, hdr->len);
+}
+
+static void write_file_header() {
+
+  uint8_t* dst = out_reserve(12);
+  uint32_t version = COMPACT_VERSION;
+
+  memcpy(dst, COMPACT_MAGIC, 8);
+  memcpy(&dst[8], &version, sizeof(version));
+}
+
+#endif
+
+static void trace_flush() {
+
+  uint8_t payload[sizeof(trace_scan_result_t) + ESP_BLE_ADV_DATA_LEN_MAX + ESP_BLE_SCAN_RSP_DATA_LEN_MAX];
+  uint32_t head = __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE);
+  uint32_t tail = ring_tail;
+
+  while (tail != head) {
+    trace_rec_hdr_t hdr;
+
+    ring_read(tail, &hdr, sizeof(hdr));
+    ring_read(tail + sizeof(hdr), payload, hdr.len);
+    tail += sizeof(hdr) + hdr.len;
+    // Hand the space back before encoding, the copy above is all we need
+    __atomic_store_n(&ring_tail, tail, __ATOMIC_RELEASE);
+
+    encode_record(&hdr, payload);
+  }
+
+  out_flush();
+}
+
+#if CONFIG_EXAMPLE_TRACE_SINK_FLASH
+
+/* Alternate between the halves so a boot never erases the capture of the run before it,
+ * which is the one that shows what led to a crash or a watchdog reset */
+static uint8_t select_flash_half() {
+
+  nvs_handle_t nvs;
+  uint8_t last = 1;
+
+  esp_err_t ret = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &nvs);
+  if (ret == ESP_OK) {
+    ret = nvs_get_u8(nvs, NVS_KEY_HALF, &last);
+    if (ret == ESP_ERR_NVS_NOT_FOUND) {
+      ret = ESP_OK;
+    }
+    if (ret == ESP_OK) {
+      ret = nvs_set_u8(nvs, NVS_KEY_HALF, !last);
+    }
+    if (ret == ESP_OK) {
+      ret = nvs_commit(nvs);
+    }
+    nvs_close(nvs);
+  }
+  if (ret != ESP_OK) {
+    ESP_LOGE(TAG, "%s: nvs failed: %s, the next boot may overwrite this capture", __func__, esp_err_to_name(ret));
+  }
+
+  return !last;
+}
+
+#endif
+
+static void trace_flush_task(void* pvParameter) {
+
+  while (1) {
+    vTaskDelay(pdMS_TO_TICKS(CONFIG_EXAMPLE_TRACE_FLUSH_MS));
+    trace_flush();
+  }
+}
+
+esp_err_t trace_init() {
+
+#if CONFIG_EXAMPLE_TRACE_SINK_FLASH
+  trace_partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY,
+    CONFIG_EXAMPLE_TRACE_PARTITION_LABEL);
+  if (trace_partition == NULL) {
+    ESP_LOGE(TAG, "%s: No data partition labelled \"%s\", flash partitions_trace.csv or use the UART sink",
+      __func__, CONFIG_EXAMPLE_TRACE_PARTITION_LABEL);
+    return ESP_ERR_NOT_FOUND;
+  }
+  flash_half_size = (trace_partition->size / 2) & ~(SPI_FLASH_SEC_SIZE - 1);
+  if (flash_half_size == 0) {
+    ESP_LOGE(TAG, "%s: Partition \"%s\" is smaller than two sectors", __func__, CONFIG_EXAMPLE_TRACE_PARTITION_LABEL);
+    return ESP_ERR_INVALID_SIZE;
+  }
+  // Every boot starts a new capture in the other half, erased (0xFF) flash marks its end
+  flash_half = select_flash_half();
+  flash_write_offset = flash_half * flash_half_size;
+  flash_erased_end = flash_write_offset;
+  flash_end = flash_write_offset + flash_half_size;
+#else
+  uart_config_t uart_config = {
+    .baud_rate = CONFIG_EXAMPLE_TRACE_UART_BAUD,
+    .data_bits = UART_DATA_8_BITS,
+    .parity = UART_PARITY_DISABLE,
+    .stop_bits = UART_STOP_BITS_1,
+    .flow_ctrl = UART_HW_FLOWCTRL_DISABLE,
+    .source_clk = UART_SCLK_APB,
+  };
+
+  // TX only, the RX buffer just has to satisfy the driver
+  esp_err_t ret = uart_driver_install(CONFIG_EXAMPLE_TRACE_UART_NUM, 256, 2 * OUT_BUF_SIZE, 0, NULL, 0);
+  if (ret == ESP_OK) {
+    ret = uart_param_config(CONFIG_EXAMPLE_TRACE_UART_NUM, &uart_config);
+  }
+  if (ret == ESP_OK) {
+    ret = uart_set_pin(CONFIG_EXAMPLE_TRACE_UART_NUM, CONFIG_EXAMPLE_TRACE_UART_TX_PIN,
+      UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE);
+  }
+  if (ret != ESP_OK) {
+    ESP_LOGE(TAG, "%s: UART setup failed: %s", __func__, esp_err_to_name(ret));
+    return ret;
+  }
+#endif
+
+  write_file_header();
+  out_flush();
+
+#if CONFIG_EXAMPLE_STATIC_ALLOCATION
+  if (xTaskCreateStatic(&trace_flush_task, "trace_flush", FLUSH_TASK_STACK, NULL, 2,
+    flush_task_stack, &flush_task_buffer) == NULL) {
+    ESP_LOGE(TAG, "%s: Unable to create flush task", __func__);
+    return ESP_ERR_NO_MEM;
+  }
+  mem_budget_add("trace", sizeof(ring) + sizeof(out_buf) + sizeof(flush_task_stack) + sizeof(flush_task_buffer));
+#else
+  if (xTaskCreate(&trace_flush_task, "trace_flush", FLUSH_TASK_STACK, NULL, 2, NULL) != pdPASS) {
+    ESP_LOGE(TAG, "%s: Unable to create flush task", __func__);
+    return ESP_ERR_NO_MEM;
+  }
+  mem_budget_add("trace", sizeof(ring) + sizeof(out_buf));
+#endif
+
+  trace_enabled = true;
+  return ESP_OK;
+}
+
+void display_trace_stats() {
+
+  uint32_t avg_cycles = trace_stats.records ? trace_stats.record_cycles / trace_stats.records : 0;
+
+  if (!trace_enabled) {
+    printf("Trace disabled\n");
+    return;
+  }
+  printf("Trace records %u, dropped %u, bytes written %u, lost %u\n", trace_stats.records, ring_drops,
+    trace_stats.bytes_written, trace_stats.bytes_lost);
+  printf("Cycles per record: avg %u, max %u\n", avg_cycles, trace_stats.max_record_cycles);
+#if CONFIG_EXAMPLE_TRACE_SINK_FLASH
+  printf("Capture at 0x%x, previous boot's at 0x%x, %u bytes each\n", flash_half * flash_half_size,
+    !flash_half * flash_half_size, flash_half_size);
+#endif
+}
+
+#endif
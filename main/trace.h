@@ -0,0 +1,22 @@
+#pragma once
+
+#include "esp_err.h"
+#include "esp_gap_ble_api.h"
+#include "esp_gattc_api.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+  /* Records are pushed from the Bluedroid callbacks, which all run in the BTC task.
+   * The ring is single producer / single consumer, do not record from anywhere else. */
+  /* On failure tracing stays off and the record functions return at once */
+  esp_err_t trace_init();
+  void trace_record_scan_result(const struct ble_scan_result_evt_param* scan_rst);
+  void trace_record_gattc_event(esp_gattc_cb_event_t event, const esp_ble_gattc_cb_param_t* param);
+  void display_trace_stats();
+
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,249 @@
+/* Decodes per second of beacon_decode over synthetic adv + scan response payloads.
+ * Every payload is checked against the format it was generated as, a wrong decode fails the run. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "esp_gap_ble_api.h"
+#include "beacon.h"
+
+#define PAYLOADS      4096
+#define ROUNDS        512
+#define PAYLOAD_MAX   (ESP_BLE_ADV_DATA_LEN_MAX + ESP_BLE_SCAN_RSP_DATA_LEN_MAX)
+
+typedef struct {
+  uint8_t data[PAYLOAD_MAX];
+  uint16_t len;
+  beacon_type_t expected;
+} payload_t;
+
+typedef uint16_t (*generate_fn)(uint8_t* p);
+
+typedef struct {
+  const char* name;
+  generate_fn generate;
+  beacon_type_t expected;
+  uint8_t mix_pct;          // share in the mixed stream
+} stream_t;
+
+static payload_t payloads[PAYLOADS];
+static uint32_t rng_state = 0x12345678;
+
+// xorshift32, fixed seed so runs are comparable
+static uint32_t rng() {
+
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 17;
+  rng_state ^= rng_state << 5;
+
+  return rng_state;
+}
+
+static void random_bytes(uint8_t* p, int len) {
+  for (int idx = 0; idx < len; idx++) {
+    p[idx] = rng();
+  }
+}
+
+static uint16_t put_flags(uint8_t* p) {
+
+  p[0] = 2;
+  p[1] = ESP_BLE_AD_TYPE_FLAG;
+  p[2] = 0x06;
+
+  return 3;
+}
+
+// Complete 16-bit service list with 0xFEAA, then the service data header of a frame of frame_len bytes
+static uint16_t put_eddystone_header(uint8_t* p, uint8_t frame_len) {
+
+  uint16_t pos = put_flags(p);
+
+  p[pos++] = 3;
+  p[pos++] = ESP_BLE_AD_TYPE_16SRV_CMPL;
+  p[pos++] = 0xAA;
+  p[pos++] = 0xFE;
+  p[pos++] = 3 + frame_len;
+  p[pos++] = ESP_BLE_AD_TYPE_SERVICE_DATA;
+  p[pos++] = 0xAA;
+  p[pos++] = 0xFE;
+
+  return pos;
+}
+
+static uint16_t generate_ibeacon(uint8_t* p) {
+
+  uint16_t pos = put_flags(p);
+
+  p[pos++] = 26;
+  p[pos++] = ESP_BLE_AD_MANUFACTURER_SPECIFIC_TYPE;
+  p[pos++] = 0x4C;
+  p[pos++] = 0x00;
+  p[pos++] = 0x02;
+  p[pos++] = 0x15;
+  random_bytes(&p[pos], 16 + 2 + 2 + 1);
+
+  return pos + 21;
+}
+
+static uint16_t generate_eddystone_uid(uint8_t* p) {
+
+  uint16_t pos = put_eddystone_header(p, 20);
+
+  p[pos++] = 0x00;
+  random_bytes(&p[pos], 1 + 10 + 6);
+  pos += 17;
+  p[pos++] = 0;
+  p[pos++] = 0;
+
+  return pos;
+}
+
+static uint16_t generate_eddystone_url(uint8_t* p) {
+
+  static const char host[] = "example";
+  uint8_t frame_len = 3 + sizeof(host) - 1 + 1;
+  uint16_t pos = put_eddystone_header(p, frame_len);
+
+  p[pos++] = 0x10;
+  p[pos++] = rng();
+  p[pos++] = rng() % 4;
+  memcpy(&p[pos], host, sizeof(host) - 1);
+  pos += sizeof(host) - 1;
+  p[pos++] = rng() % 14;
+
+  return pos;
+}
+
+static uint16_t generate_eddystone_tlm(uint8_t* p) {
+
+  uint16_t pos = put_eddystone_header(p, 14);
+
+  p[pos++] = 0x20;
+  p[pos++] = 0x00;
+  random_bytes(&p[pos], 2 + 2 + 4 + 4);
+
+  return pos + 12;
+}
+
+static uint16_t generate_custom(uint8_t* p) {
+
+  uint16_t pos = put_flags(p);
+  uint8_t len = 1 + rng() % BEACON_CUSTOM_MAX_LEN;
+
+  p[pos++] = 3 + len;
+  p[pos++] = ESP_BLE_AD_MANUFACTURER_SPECIFIC_TYPE;
+  p[pos++] = CONFIG_EXAMPLE_BEACON_CUSTOM_COMPANY_ID & 0xFF;
+  p[pos++] = CONFIG_EXAMPLE_BEACON_CUSTOM_COMPANY_ID >> 8;
+  random_bytes(&p[pos], len);
+
+  return pos + len;
+}
+
+// Phones, headsets and the like: a name in the scan response and manufacturer data nobody decodes
+static uint16_t generate_other(uint8_t* p) {
+
+  uint16_t pos = put_flags(p);
+  uint8_t mfg_len = 4 + rng() % 16;
+  uint8_t name_len = 4 + rng() % 12;
+
+  p[pos++] = 3 + mfg_len;
+  p[pos++] = ESP_BLE_AD_MANUFACTURER_SPECIFIC_TYPE;
+  p[pos++] = 0x06;
+  p[pos++] = 0x00;
+  random_bytes(&p[pos], mfg_len);
+  pos += mfg_len;
+
+  p[pos++] = 1 + name_len;
+  p[pos++] = ESP_BLE_AD_TYPE_NAME_CMPL;
+  for (int idx = 0; idx < name_len; idx++) {
+    p[pos++] = 'a' + rng() % 26;
+  }
+
+  return pos;
+}
+
+static const stream_t streams[] = {
+  { "iBeacon", generate_ibeacon, BEACON_TYPE_IBEACON, 20 },
+  { "Eddystone-UID", generate_eddystone_uid, BEACON_TYPE_EDDYSTONE_UID, 10 },
+  { "Eddystone-URL", generate_eddystone_url, BEACON_TYPE_EDDYSTONE_URL, 10 },
+  { "Eddystone-TLM", generate_eddystone_tlm, BEACON_TYPE_EDDYSTONE_TLM, 10 },
+  { "Custom", generate_custom, BEACON_TYPE_CUSTOM, 10 },
+  { "Not a beacon", generate_other, BEACON_TYPE_NONE, 40 },
+};
+
+#define STREAMS (sizeof(streams) / sizeof(streams[0]))
+
+static void fill(const stream_t* stream, payload_t* payload) {
+
+  payload->len = stream->generate(payload->data);
+  payload->expected = stream->expected;
+}
+
+// Pick the stream of each payload by its share, -1 for the mixed stream
+static void generate_payloads(int only) {
+
+  for (int idx = 0; idx < PAYLOADS; idx++) {
+    int pick = only;
+
+    if (pick < 0) {
+      uint32_t pct = rng() % 100;
+      for (pick = 0; pick < STREAMS - 1 && pct >= streams[pick].mix_pct; pick++) {
+        pct -= streams[pick].mix_pct;
+      }
+    }
+    fill(&streams[pick], &payloads[idx]);
+  }
+}
+
+static double now_s() {
+
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Returns the number of wrong decodes
+static int run(const char* name) {
+
+  beacon_record_t record;
+  int errors = 0;
+
+  for (int idx = 0; idx < PAYLOADS; idx++) {
+    beacon_decode(payloads[idx].data, payloads[idx].len, &record);
+    if (record.type != payloads[idx].expected) {
+      errors++;
+    }
+  }
+
+  double start = now_s();
+  for (int round = 0; round < ROUNDS; round++) {
+    for (int idx = 0; idx < PAYLOADS; idx++) {
+      beacon_decode(payloads[idx].data, payloads[idx].len, &record);
+    }
+  }
+  double elapsed = now_s() - start;
+  double decodes = (double)ROUNDS * PAYLOADS;
+
+  printf("%-16s %12.0f %10.1f %8d\n", name, decodes / elapsed, elapsed * 1e9 / decodes, errors);
+
+  return errors;
+}
+
+int main() {
+
+  int errors = 0;
+
+  printf("%-16s %12s %10s %8s\n", "stream", "decodes/s", "ns/decode", "errors");
+  for (int idx = 0; idx < STREAMS; idx++) {
+    generate_payloads(idx);
+    errors += run(streams[idx].name);
+  }
+  generate_payloads(-1);
+  errors += run("Mixed");
+
+  return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,154 @@
+/* Accuracy of the occupancy unique counts against sketch memory, over synthetic address streams.
+ * Built once per HyperLogLog precision, the clock is simulated so whole windows take no time.
+ * Every device reports 1 to 4 times with a manufacturer ID from a small set, like a real crowd. */
+
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sdkconfig.h"
+#include "esp_timer.h"
+#include "mem_budget.h"
+#include "occupancy.h"
+
+#define TRIALS        32
+#define WINDOW_US     ((int64_t)CONFIG_EXAMPLE_OCCUPANCY_WINDOW_S * 1000000)
+#define BUCKET_US     (WINDOW_US / CONFIG_EXAMPLE_OCCUPANCY_BUCKETS)
+#define HLL_REGISTERS (1 << CONFIG_EXAMPLE_OCCUPANCY_HLL_BITS)
+
+static const uint32_t device_counts[] = { 10, 100, 1000, 10000, 50000 };
+
+#define DEVICE_COUNTS (sizeof(device_counts) / sizeof(device_counts[0]))
+
+static int64_t now_us = 0;
+static uint64_t rng_state = 0x9E3779B97F4A7C15ULL;
+
+int64_t esp_timer_get_time(void) {
+  return now_us;
+}
+
+void mem_budget_add(const char* name, size_t bytes) {
+}
+
+// xorshift64, fixed seed so runs are comparable
+static uint64_t rng() {
+
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+
+  return rng_state;
+}
+
+static void report_device(uint64_t address) {
+
+  struct ble_scan_result_evt_param scan_rst;
+  uint16_t company = 0x0006 + rng() % 8;
+
+  memset(&scan_rst, 0, sizeof(scan_rst));
+  for (int idx = 0; idx < ESP_BD_ADDR_LEN; idx++) {
+    scan_rst.bda[idx] = address >> (8 * idx);
+  }
+  scan_rst.ble_adv[0] = 3;
+  scan_rst.ble_adv[1] = ESP_BLE_AD_MANUFACTURER_SPECIFIC_TYPE;
+  scan_rst.ble_adv[2] = company & 0xFF;
+  scan_rst.ble_adv[3] = company >> 8;
+  scan_rst.adv_data_len = 4;
+
+  for (int repeat = 1 + rng() % 4; repeat > 0; repeat--) {
+    occupancy_record(&scan_rst);
+  }
+}
+
+// Jump past the window, the next report clears every bucket
+static void next_window() {
+  now_us += WINDOW_US + BUCKET_US;
+}
+
+// Small counts go through linear counting, allow three standard errors of rounding
+static int check(const char* what, uint32_t value, uint32_t expected) {
+
+  uint32_t slack = (uint32_t)(expected * 3 * 1.04 / sqrt(HLL_REGISTERS));
+  if (value + slack < expected || value > expected + slack) {
+    printf("FAIL %s: %" PRIu32 ", expected %" PRIu32 " +- %" PRIu32 "\n", what, value, expected, slack);
+    return 1;
+  }
+
+  return 0;
+}
+
+// Buckets older than the first report, then the window sliding bucket by bucket
+static int check_window() {
+
+  int errors = 0;
+
+  report_device(rng());
+  for (int age = 1; age < CONFIG_EXAMPLE_OCCUPANCY_BUCKETS; age++) {
+    errors += check("bucket before the first report", occupancy_bucket_unique(age), 0);
+  }
+
+  next_window();
+  for (int age = CONFIG_EXAMPLE_OCCUPANCY_BUCKETS - 1; age >= 0; age--) {
+    for (int idx = 0; idx < 10; idx++) {
+      report_device(rng());
+    }
+    if (age > 0) {
+      now_us += BUCKET_US;
+    }
+  }
+  for (int age = 0; age < CONFIG_EXAMPLE_OCCUPANCY_BUCKETS; age++) {
+    errors += check("unique in one bucket", occupancy_bucket_unique(age), 10);
+  }
+
+  now_us += WINDOW_US;
+  errors += check("unique after the window passed", occupancy_unique(), 0);
+
+  return errors;
+}
+
+int main() {
+
+  // Standard error 1.04 / sqrt(m), a run fails beyond three times that
+  double expected = 1.04 / sqrt(HLL_REGISTERS);
+  int errors = 0;
+
+  if (occupancy_init() != ESP_OK) {
+    return EXIT_FAILURE;
+  }
+  errors += check_window();
+
+  printf("%4s %10s %8s %12s %8s %8s %8s\n", "bits", "HLL bytes", "devices", "mean est.", "bias %", "rms %",
+    "std. %");
+  for (int count_idx = 0; count_idx < DEVICE_COUNTS; count_idx++) {
+    uint32_t devices = device_counts[count_idx];
+    double sum = 0;
+    double sum_rel = 0;
+    double sum_sq = 0;
+
+    for (int trial = 0; trial < TRIALS; trial++) {
+      next_window();
+      for (int idx = 0; idx < devices; idx++) {
+        report_device(rng());
+      }
+
+      uint32_t unique = occupancy_unique();
+      double rel = ((double)unique - devices) / devices;
+      sum += unique;
+      sum_rel += rel;
+      sum_sq += rel * rel;
+    }
+
+    double rms = sqrt(sum_sq / TRIALS);
+    printf("%4d %10d %8u %12.1f %8.2f %8.2f %8.2f\n", CONFIG_EXAMPLE_OCCUPANCY_HLL_BITS,
+      CONFIG_EXAMPLE_OCCUPANCY_BUCKETS * HLL_REGISTERS, devices, sum / TRIALS, 100 * sum_rel / TRIALS,
+      100 * rms, 100 * expected);
+    if (rms > 3 * expected) {
+      printf("FAIL rms error above three standard errors\n");
+      errors++;
+    }
+  }
+
+  return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+/* The subset of the Bluedroid GAP API used by the host benchmarks */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define ESP_BD_ADDR_LEN 6
+typedef uint8_t esp_bd_addr_t[ESP_BD_ADDR_LEN];
+
+#define ESP_BLE_ADV_DATA_LEN_MAX      31
+#define ESP_BLE_SCAN_RSP_DATA_LEN_MAX 31
+
+#define ESP_BLE_AD_TYPE_FLAG                  0x01
+#define ESP_BLE_AD_TYPE_16SRV_PART            0x02
+#define ESP_BLE_AD_TYPE_16SRV_CMPL            0x03
+#define ESP_BLE_AD_TYPE_NAME_CMPL             0x09
+#define ESP_BLE_AD_TYPE_TX_PWR                0x0A
+#define ESP_BLE_AD_TYPE_SERVICE_DATA          0x16
+#define ESP_BLE_AD_MANUFACTURER_SPECIFIC_TYPE 0xFF
+
+/* The fields of a scan report the sources read */
+struct ble_scan_result_evt_param {
+  esp_bd_addr_t bda;
+  int rssi;
+  uint8_t ble_adv[ESP_BLE_ADV_DATA_LEN_MAX + ESP_BLE_SCAN_RSP_DATA_LEN_MAX];
+  uint8_t adv_data_len;
+  uint8_t scan_rsp_len;
+};
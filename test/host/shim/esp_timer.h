@@ -0,0 +1,6 @@
+#pragma once
+
+#include <stdint.h>
+
+/* Provided by each benchmark, so it can move the clock */
+int64_t esp_timer_get_time(void);
@@ -0,0 +1,14 @@
+#pragma once
+
+/* Single threaded host runs: locks always succeed, timers never fire */
+
+#include <stdint.h>
+
+typedef uint32_t TickType_t;
+typedef long BaseType_t;
+
+#define pdFALSE          0
+#define pdTRUE           1
+#define pdPASS           1
+#define portMAX_DELAY    UINT32_MAX
+#define pdMS_TO_TICKS(ms) ((TickType_t)(ms))
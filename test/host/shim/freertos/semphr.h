@@ -0,0 +1,23 @@
+#pragma once
+
+#include "freertos/FreeRTOS.h"
+
+typedef void* SemaphoreHandle_t;
+typedef struct {
+  int unused;
+} StaticSemaphore_t;
+
+#define xSemaphoreCreateMutex()             ((SemaphoreHandle_t)1)
+#define xSemaphoreCreateMutexStatic(buffer) ((SemaphoreHandle_t)(buffer))
+
+// The host harness is single threaded, the lock always succeeds
+static inline BaseType_t xSemaphoreTake(SemaphoreHandle_t lock, TickType_t ticks) {
+  (void)lock;
+  (void)ticks;
+  return pdTRUE;
+}
+
+static inline BaseType_t xSemaphoreGive(SemaphoreHandle_t lock) {
+  (void)lock;
+  return pdTRUE;
+}
@@ -0,0 +1,16 @@
+#include <string.h>
+
+#include "host_compat.h"
+
+size_t host_strlcpy(char* dst, const char* src, size_t size) {
+
+  size_t len = strlen(src);
+
+  if (size > 0) {
+    size_t copy = len < size - 1 ? len : size - 1;
+    memcpy(dst, src, copy);
+    dst[copy] = '\0';
+  }
+
+  return len;
+}
@@ -0,0 +1,7 @@
+#pragma once
+
+#include <stddef.h>
+
+/* newlib extras the sources rely on that glibc doesn't have */
+#define strlcpy host_strlcpy
+size_t host_strlcpy(char* dst, const char* src, size_t size);
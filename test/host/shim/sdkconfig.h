@@ -0,0 +1,42 @@
+#pragma once
+
+/* Menuconfig defaults, plus the features that are off by default so they can be measured.
+ * Each value can be overridden with -D. */
+
+#ifndef CONFIG_EXAMPLE_BEACON_IBEACON
+#define CONFIG_EXAMPLE_BEACON_IBEACON 1
+#endif
+#ifndef CONFIG_EXAMPLE_BEACON_EDDYSTONE_UID
+#define CONFIG_EXAMPLE_BEACON_EDDYSTONE_UID 1
+#endif
+#ifndef CONFIG_EXAMPLE_BEACON_EDDYSTONE_URL
+#define CONFIG_EXAMPLE_BEACON_EDDYSTONE_URL 1
+#endif
+#ifndef CONFIG_EXAMPLE_BEACON_EDDYSTONE_TLM
+#define CONFIG_EXAMPLE_BEACON_EDDYSTONE_TLM 1
+#endif
+#ifndef CONFIG_EXAMPLE_BEACON_CUSTOM
+#define CONFIG_EXAMPLE_BEACON_CUSTOM 1
+#endif
+#ifndef CONFIG_EXAMPLE_BEACON_CUSTOM_COMPANY_ID
+#define CONFIG_EXAMPLE_BEACON_CUSTOM_COMPANY_ID 0xFFFF
+#endif
+
+#ifndef CONFIG_EXAMPLE_OCCUPANCY
+#define CONFIG_EXAMPLE_OCCUPANCY 1
+#endif
+#ifndef CONFIG_EXAMPLE_OCCUPANCY_WINDOW_S
+#define CONFIG_EXAMPLE_OCCUPANCY_WINDOW_S 300
+#endif
+#ifndef CONFIG_EXAMPLE_OCCUPANCY_BUCKETS
+#define CONFIG_EXAMPLE_OCCUPANCY_BUCKETS 5
+#endif
+#ifndef CONFIG_EXAMPLE_OCCUPANCY_HLL_BITS
+#define CONFIG_EXAMPLE_OCCUPANCY_HLL_BITS 9
+#endif
+#ifndef CONFIG_EXAMPLE_OCCUPANCY_CMS_WIDTH_BITS
+#define CONFIG_EXAMPLE_OCCUPANCY_CMS_WIDTH_BITS 7
+#endif
+#ifndef CONFIG_EXAMPLE_OCCUPANCY_REPORT_S
+#define CONFIG_EXAMPLE_OCCUPANCY_REPORT_S 0
+#endif